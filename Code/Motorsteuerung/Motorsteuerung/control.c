@@ -0,0 +1,711 @@
+/*
+ * control.c
+ *
+ * Created: 17/10/2026
+ * Motoren, PWM, Rampe, Drehzahlregelung, Fehlerabschaltung und Strombegrenzung
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
+#include "zkslibadc.h"
+#include "defines.h"
+
+Motor_t Motor[MotorCount] = {
+	{.Port=&MOTOR_PORT, .PinForward=MOTOR_Forward, .PinReverse=MOTOR_Reverse, .EnPort=&MOTOR_PORT, .PinEnable=MOTOR_Enable, .Drive=DriveDefault, .DutyReg=&DutyCycle, .SampleReg=&SamplePoint, .OutDirection=DirBrake, .Duty8=0xff},
+#ifdef MOTOR2
+	{.Port=&MOTOR2_PORT, .PinForward=MOTOR2_Forward, .PinReverse=MOTOR2_Reverse, .EnPort=&MOTOR2_EN_PORT, .PinEnable=MOTOR2_Enable, .Drive=DriveDefault, .Follow=1, .DutyReg=&OCR2B, .SampleReg=&OCR2A, .OutDirection=DirBrake, .Duty8=0xff},
+#endif
+};
+volatile unsigned char mode = 0;
+volatile unsigned char stopped = Go;
+adc_Snapshot_t AdcSnapshot;	//Alle Messwerte aus einem Scan-Durchlauf
+unsigned int VccMilliVolt = ADC_VCC_NOM_MV;	//Gemessene Versorgungsspannung, sinkt unter Last des Motors
+adc_mVScale_t MeasureScale;			//Umrechnung der Messkanle in mV, folgt VccMilliVolt
+unsigned int MeasureScaleVcc = 0;	//Vcc, mit der MeasureScale berechnet wurde
+unsigned char PwmDirection = 0;	//Richtung, auf die die Compare-Ausgnge eingestellt sind (PWMHARDWARE)
+unsigned int PwmTop = 0;		//TOP von Timer1 (ICR1), Auflsung der PWM in Schritten
+unsigned int PwmCompare = 0;	//Zuletzt nach OCR1A/OCR1B geschriebener Wert
+volatile unsigned int SysTick = 0;	//Zeitbasis in ms, gezhlt in der berlauf-ISR der PWM
+unsigned char PwmTickCnt = 0;		//PWM-Perioden seit dem letzten SysTick
+unsigned char PwmTicksPerMs = PwmTicksPerMsT0;	//PWM-Perioden pro SysTick, hngt von der PWM-Frequenz ab
+unsigned int PwmPeriodUs = 0;		//Dauer einer PWM-Periode in us (PWMHARDWARE), Auflsung der Laufzeitmessung
+unsigned int RampAccelStep = 32768/RampAccelMs;	//Grsste Zunahme des Duty Cycle pro ms
+unsigned int RampDecelStep = 32768/RampDecelMs;	//Grsste Abnahme des Duty Cycle pro ms
+unsigned int RampTick = 0;			//SysTick beim letzten RampUpdate
+unsigned char RampProfile = ProfileDefault;	//Verlauf der bergnge aller Motoren, zur Laufzeit nderbar
+unsigned int SpeedSetQ15 = 0;		//Sollwert des Reglers (Ausgang der Rampe von Motor 1)
+unsigned long DriveSum[3];			//Vcc, Messkanal 1 und 2 in mV gefiltert (EMA), Wert * 2^DriveAvgBits
+unsigned int DriveSeqNr = 0;		//Snapshot der letzten Mittelung
+unsigned char DriveSeed = 1;		//Mittelung mit dem nchsten Wert neu beginnen
+unsigned int SpeedActQ15 = 0;		//Istwert der Drehzahl
+int SpeedKp = SpeedKpDefault;		//Reglerparameter, zur Laufzeit nderbar
+int SpeedKi = SpeedKiDefault;
+unsigned int SpeedOutMin = SpeedOutMinDefault;	//Grenzen des Duty Cycle
+unsigned int SpeedOutMax = SpeedOutMaxDefault;
+long SpeedInt = 0;					//Integralanteil in Q27 (Duty Q15 * 4096)
+long SpeedErrSum = 0;				//Regelabweichung gefiltert (EMA 1/16), Q15 * 16
+unsigned int SpeedTargetLast = 0;	//Rampen-Sollwert beim Start der Messung der Einschwingzeit
+unsigned int SpeedStartTick = 0;	//SysTick beim Start der Messung
+unsigned int SpeedSettleMs = 0;		//Zuletzt gemessene Einschwingzeit in ms
+unsigned char SpeedSettled = 1;
+#if SpeedSource==SpeedSrcBemf
+volatile unsigned char BemfState = BemfIdle;
+unsigned char BemfCnt = BemfPeriods;	//PWM-Perioden bis zur nchsten Messung (ISR)
+unsigned char BemfChannel = MeasureChannel1;	//Kanal der letzten Messung (ISR)
+unsigned int BemfRaw[2] = {0, 0};	//Letzte Klemmenspannung von Kanal 1 und 2 im Freilauf (10 Bit)
+unsigned char BemfInjCnt = 0;		//Zhler der eingeschobenen Wandlungen beim letzten Auslesen
+unsigned long BemfSum = 0;			//Drehzahl gefiltert, Q15 * 2^BemfFiltBits
+#endif
+#ifdef TACHO
+volatile unsigned int TachOvf = 0;	//Obere 16 Bit des Zeitstempels (berlufe von Timer1)
+volatile unsigned long TachLastEdge = 0;	//Zeitstempel der letzten Flanke in Timer-Schritten
+volatile unsigned long TachSum = 0;	//Summe der Perioden im Fenster
+volatile unsigned char TachCnt = 0;	//Anzahl Perioden im Fenster, 0 = noch keine Periode nach Stillstand
+unsigned char TachRun = 0;			//TachLastEdge ist gltig (nur ISR)
+unsigned long TachPeriod[1<<TachAvgBits];	//Fenster der letzten Perioden (nur ISR)
+unsigned char TachIdx = 0;			//Schreibindex im Fenster (nur ISR)
+#endif
+volatile unsigned char CurLimCut = 0;	//PWMHARDWARE: Ein-Phase der laufenden Periode wurde durch die Strombegrenzung beendet
+volatile unsigned char CurLimOn = 0;	//Software-PWM: Ein-Phase von Motor 1 luft, die Strombegrenzung ist wirksam
+volatile unsigned char CurLimStart = 0;	//Software-PWM: TCNT0 beim Beginn der Ein-Phase, Start der Austastzeit
+volatile unsigned int CurLimCount = 0;	//Anzahl gekrzter Perioden
+volatile unsigned char PwmCom = 0;		//Compare-Output-Modes der Richtung (PWMHARDWARE), bei CurLimCut getrennt
+volatile unsigned int FaultLatency = 0;	//Zeit von der Komparator-Flanke bis Brake in CPU-Takten (Timer1 ohne Prescaler, 0 bei PWMHARDWARE)
+#ifdef PWMHARDWARE
+const unsigned int PwmFreqTable[] PROGMEM = {4000, 8000, 16000, 20000, 25000};	//Whlbare PWM-Frequenzen in Hz
+#endif
+//Verlufe der Rampe, 0..32768 ber den Fortschritt 0..1 in (1<<ProfileBits) Abschnitten
+const unsigned int ProfileTable[ProfileCount][(1<<ProfileBits)+1] PROGMEM = {
+	{0, 1024, 2048, 3072, 4096, 5120, 6144, 7168, 8192, 9216, 10240, 11264, 12288, 13312, 14336, 15360, 16384,
+	 17408, 18432, 19456, 20480, 21504, 22528, 23552, 24576, 25600, 26624, 27648, 28672, 29696, 30720, 31744, 32768},
+	{0, 79, 315, 705, 1247, 1935, 2761, 3719, 4799, 5990, 7282, 8661, 10114, 11628, 13188, 14778, 16384,
+	 17990, 19580, 21140, 22654, 24107, 25486, 26778, 27969, 29049, 30007, 30833, 31521, 32063, 32453, 32689, 32768},
+	{0, 4772, 8854, 12345, 15332, 17886, 20071, 21940, 23538, 24906, 26075, 27075, 27931, 28663, 29289, 29824, 30282,
+	 30674, 31009, 31296, 31541, 31750, 31930, 32083, 32214, 32327, 32423, 32505, 32575, 32635, 32686, 32730, 32768}
+};
+const unsigned char ProfileSlope[ProfileCount] PROGMEM = {16, 26, 75};	//Steilste Stelle relativ zur mittleren Steigung in Q4
+
+void CCW_CW(){
+	switch(PIND & (CCW | CW)){
+		case CW:
+			Motor[0].Direction = DirForward;
+			LED_Green_Off;
+			LED_Red_On;
+			break;
+		case CCW:
+			Motor[0].Direction = DirReverse;
+			LED_Green_On;
+			LED_Red_Off;
+			break;
+		default:
+			Motor[0].Direction = DirBrake;
+			LED_Red_Off;
+			LED_Green_Off;
+			break;
+	}
+}
+
+void Auto_Man(){
+	switch(PIND & (MAN | AUTO)){
+		case MAN:
+			mode=ModeMan;
+			break;
+		case AUTO:
+			mode=ModeAuto;
+			break;
+		default:
+			mode=ModeStop;
+			break;
+	}
+}
+
+#ifdef PWMHARDWARE
+//Duty Cycle im Q15-Format setzen (0 = Stillstand, 32768 = 100%), Compare = Duty*TOP/2^15
+//Die Ein-Phase liegt symmetrisch um BOTTOM, dort startet Timer1 auch die ADC-Wandlung
+//OCR1A/OCR1B werden von der Hardware erst bei BOTTOM bernommen, geschrieben wird nur bei einer nderung
+//Mit PWMHARDWARE gibt es nur Motor 1
+void SetDutyQ15(Motor_t * M, unsigned int Duty){
+	unsigned int Compare;
+	unsigned char Sreg;
+	if(Duty>32768) Duty=32768;
+	M->DutyQ15=Duty;
+	Compare=((unsigned long)Duty*PwmTop)>>15;
+	if(Compare==PwmCompare) return;
+	PwmCompare=Compare;
+	Sreg=SREG;
+	cli();
+	OCR1A=Compare;
+	OCR1B=Compare;
+	SREG=Sreg;
+}
+
+//Duty Cycle wie bei der Software-PWM: Ein-Phase 256-Duty von 256 Schritten, 255 = Stillstand
+void SetDutyCycle(Motor_t * M, unsigned char Duty){
+	SetDutyQ15(M, (unsigned int)(256-Duty)<<7);
+}
+
+//PWM-Frequenz in Hz whlen, TOP = F_CPU/(2*f) ohne Prescaler fr die grsste Auflsung
+//z.B. 4kHz: 2000 Schritte, 20kHz: 400 Schritte, 25kHz: 320 Schritte
+//Der Timer wird dafr kurz angehalten, da ICR1 nicht gepuffert ist (Aus-Phase = Brake)
+unsigned char SetPwmFrequency(unsigned int Hz){
+	unsigned long Top;
+	unsigned char Sreg;
+	if(Hz==0) return 0;
+	Top=(F_CPU/2)/Hz;
+	if((Top<PwmTopMin)||(Top>0xffff)) return 0;
+	Sreg=SREG;
+	cli();
+	TCCR1B&=~((1<<CS12)|(1<<CS11)|(1<<CS10));
+	PwmTicksPerMs=(Hz+500)/1000;	//SysTick bleibt bei ca. 1ms
+	if(PwmTicksPerMs==0) PwmTicksPerMs=1;
+	PwmPeriodUs=(unsigned int)(Top/(F_CPU/2000000UL));
+	PwmTickCnt=0;
+	PwmTop=(unsigned int)Top;
+	ICR1=PwmTop;
+	TCNT1=0;
+	SetDutyQ15(&Motor[0], Motor[0].DutyQ15);
+	TCCR1B|=(1<<CS10);
+	SREG=Sreg;
+	return 1;
+}
+
+//Richtung auf die Compare-Ausgnge bertragen, nur bei einer nderung
+//Gesperrte Interrupts, damit die Fehlerabschaltung nicht zwischen Lesen und Schreiben von TCCR1A fllt
+void ApplyDirection(){
+	unsigned char Sreg;
+	if(Motor[0].OutDirection==PwmDirection) return;
+	Sreg=SREG;
+	cli();
+	PwmDirection=Motor[0].OutDirection;
+	switch(PwmDirection){
+		case DirForward:
+			Forward;
+			break;
+		case DirReverse:
+			Reverse;
+			break;
+		default:
+			Brake;
+			break;
+	}
+#ifdef MOTORFAULT
+	if(MotorFault){
+		Brake;
+	}
+#endif
+#ifdef CURRENTLIMIT
+	PwmCom=TCCR1A&PwmComMask;	//Schaltet die Capture ISR bei TOP wieder ein
+	if(CurLimCut){
+		Brake;
+	}
+#endif
+	SREG=Sreg;
+}
+
+//Timer1 als Phase and Frequency Correct PWM mit TOP in ICR1, Compare-Ausgnge invertierend
+//Der berlauf (BOTTOM, Mitte der Ein-Phase) startet die ADC-Wandlung (ADC_TRIG_T1_OVF)
+//und zhlt in der ISR den SysTick
+void timer1_init() {
+	MotorOut(OutBrake);	//Ohne Compare-Ausgang gilt PORTB, beide Pins bleiben auf 1
+	TCCR1A=0;
+	TCCR1B=(1<<WGM13);
+	Motor[0].DutyQ15=0;
+	SetPwmFrequency(PwmFreqDefault);
+	TIMSK1|=(1<<TOIE1);
+	sei();
+}
+#else
+//Duty Cycle setzen und den Abtastzeitpunkt des ADC in die Mitte der Ein-Phase legen
+//Die Ein-Phase dauert von DutyCycle bis zum berlauf (256)
+//Timer0 luft als Fast PWM ohne Compare-Ausgnge: OCR0A/OCR0B sind gepuffert und werden erst
+//beim berlauf bernommen, jede Periode wird also komplett mit einem Wert ausgefhrt
+//Ist bei Motor 1 eine Messperiode der Gegen-EMK gepuffert, schreibt die berlauf-ISR den neuen Wert danach
+//Timer2 (Motor 2) luft im selben Modus, seine Compare-Register werden ebenso erst beim berlauf bernommen
+void SetDutyCycle(Motor_t * M, unsigned char Duty){
+	unsigned char Sreg;
+	if(Duty<DutyCycleMin) Duty=DutyCycleMin;
+	if(Duty==M->Duty8) return;
+	Sreg=SREG;
+	cli();
+	M->Duty8=Duty;
+#if SpeedSource==SpeedSrcBemf
+	if((M!=&Motor[0])||(BemfState==BemfIdle))
+#endif
+	{
+		*M->DutyReg=Duty;
+		*M->SampleReg=SampleMid(Duty);
+	}
+	SREG=Sreg;
+}
+
+//Duty Cycle im Q15-Format wie bei PWMHARDWARE, 8 Bit Auflsung
+//0 = Stillstand (DutyCycle 255), 32768 = 100% (DutyCycle 0)
+//Bei DriveAntiphase wird der Betrag um 50% gelegt, Forward darber und Reverse darunter
+void SetDutyQ15(Motor_t * M, unsigned int Duty){
+	unsigned int Off;
+	if(Duty>32768) Duty=32768;
+	M->DutyQ15=Duty;
+	if(M->Drive==DriveAntiphase){
+		if(M->OutDirection==DirReverse) Duty=16384-(Duty>>1);
+		else Duty=16384+(Duty>>1);
+	}
+	Off=256-(Duty>>7);
+	if(Off>255) Off=255;
+	SetDutyCycle(M, (unsigned char)Off);
+}
+
+//Betriebsart eines Motors zur Laufzeit wechseln
+//Enable wird wieder eingeschaltet (Ende von DriveCoast) und der Duty Cycle neu umgerechnet
+void SetDriveMode(Motor_t * M, unsigned char Drive){
+	unsigned char Sreg;
+	if(Drive>=DriveCount) return;
+	Sreg=SREG;
+	cli();
+	M->Drive=Drive;
+	*M->EnPort|=M->PinEnable;
+	M->Duty8=0;		//Kein gltiger Wert (DutyCycleMin), erzwingt das Schreiben der Compare-Register
+	SetDutyQ15(M, M->DutyQ15);
+	SREG=Sreg;
+	DriveSeed=1;
+}
+
+//Vcc und die Messkanle fr den Vergleich der Betriebsarten mitteln, ein Wert pro neuem Snapshot
+//Die Vcc sinkt mit dem Strom des Motors: bei gleicher Drehzahl zeigt die kleinere Absenkung die
+//sparsamere Betriebsart, die Messkanle werden wie die ADC-Trigger in der Mitte der Ein-Phase abgetastet
+void DriveMeasure(){
+	unsigned int Value[3];
+	unsigned char i;
+	if(AdcSnapshot.SeqNr==DriveSeqNr) return;
+	DriveSeqNr=AdcSnapshot.SeqNr;
+	Value[0]=VccMilliVolt;
+	Value[1]=MeasureMilliVolt(MeasureChannel1Value);
+	Value[2]=MeasureMilliVolt(MeasureChannel2Value);
+	for(i=0;i<3;i++){
+		if(DriveSeed) DriveSum[i]=(unsigned long)Value[i]<<DriveAvgBits;
+		else DriveSum[i]+=Value[i]-(DriveSum[i]>>DriveAvgBits);
+	}
+	DriveSeed=0;
+}
+#endif
+
+#if SpeedSource==SpeedSrcBemf
+//Istwert der Drehzahl aus der Gegen-EMK
+//Jede neue eingeschobene Wandlung ersetzt den Wert ihres Kanals, die Differenz der beiden Klemmen
+//wird auf BemfFullScale normiert und geglttet. Die Rohwerte sind nicht kalibriert
+unsigned int SpeedFeedback(){
+	uint16_t Value;
+	uint8_t AdSel;
+	unsigned char Cnt;
+	unsigned int Bemf;
+	unsigned long Speed;
+	Cnt=adc_GetInject_Int(&Value, &AdSel);
+	if(Cnt!=BemfInjCnt){
+		BemfInjCnt=Cnt;
+		BemfRaw[AdSel==MeasureChannel2]=Value;
+		Bemf=abs((int)BemfRaw[1]-(int)BemfRaw[0]);
+		Speed=((unsigned long)Bemf<<15)/BemfFullScale;
+		if(Speed>32768) Speed=32768;
+		BemfSum+=Speed-(BemfSum>>BemfFiltBits);
+	}
+	return (unsigned int)(BemfSum>>BemfFiltBits);
+}
+#endif
+
+#ifdef TACHO
+//Timer1 als Zeitbasis fr den Drehzahlgeber, Rauschfilter des Input Capture ein (4 Takte)
+//ICP1 (PB0) als Eingang mit Pullup fr Hall-Sensoren mit Open-Collector
+void TachInit(){
+	DDRB&=~(1<<PB0);
+	PORTB|=(1<<PB0);
+	TCCR1A=0;
+	TCCR1B=(1<<ICNC1)|(1<<ICES1)|(1<<CS11);
+	TIFR1=(1<<ICF1)|(1<<TOV1);
+	TIMSK1|=(1<<ICIE1)|(1<<TOIE1);
+}
+
+//Aktueller Zeitstempel, mit gesperrten Interrupts aufrufen
+//Ein berlauf, dessen ISR noch nicht gelaufen ist, wird am gesetzten TOV1 erkannt
+unsigned long TachNow(){
+	unsigned int Low;
+	unsigned int High;
+	Low=TCNT1;
+	High=TachOvf;
+	if((TIFR1&(1<<TOV1))&&(Low<0x8000)) High++;
+	return ((unsigned long)High<<16)|Low;
+}
+
+//Drehzahl in 1/16 U/min, 0 bei Stillstand, EdgeTime erhlt den Zeitstempel der letzten Flanke
+//Ist seit der letzten Flanke mehr Zeit vergangen als die mittlere Periode, wird diese Zeit verwendet,
+//damit die Drehzahl beim Auslaufen bis zum Timeout stetig abnimmt
+unsigned long TachGetRpmQ4(unsigned long * EdgeTime){
+	unsigned long Sum;
+	unsigned long Since;
+	unsigned long Period;
+	unsigned char Cnt;
+	unsigned char Sreg;
+	Sreg=SREG;
+	cli();
+	Sum=TachSum;
+	Cnt=TachCnt;
+	*EdgeTime=TachLastEdge;
+	Since=TachNow()-TachLastEdge;
+	SREG=Sreg;
+	if((Cnt==0)||(Since>TachTimeout)) return 0;
+	Period=Sum/Cnt;
+	if(Since>Period) Period=Since;
+	return TachRpmQ4Const/Period;
+}
+#endif
+
+#if SpeedSource==SpeedSrcTach
+//Istwert der Drehzahl aus dem Drehzahlgeber, TachRpmMax entspricht 32768
+unsigned int SpeedFeedback(){
+	unsigned long Edge;
+	unsigned long Speed;
+	Speed=(TachGetRpmQ4(&Edge)<<11)/TachRpmMax;
+	if(Speed>32768) Speed=32768;
+	return (unsigned int)Speed;
+}
+#endif
+
+#if SpeedSource!=SpeedSrcNone
+//Einschwingzeit und bleibende Regelabweichung bestimmen
+//Die Zeit luft ab einer nderung des Rampen-Sollwerts um mehr als SpeedSettleBand, bis die Rampe
+//am Ziel ist und der Istwert zum ersten Mal im Toleranzband liegt
+void SpeedMeasure(long Err){
+	if(labs((long)Motor[0].RampTargetQ15-SpeedTargetLast)>SpeedSettleBand){
+		SpeedTargetLast=Motor[0].RampTargetQ15;
+		SpeedStartTick=RampTick;
+		SpeedSettled=0;
+	}
+	if(!SpeedSettled&&(SpeedSetQ15==Motor[0].RampTargetQ15)&&(labs(Err)<=SpeedSettleBand)){
+		SpeedSettleMs=RampTick-SpeedStartTick;
+		SpeedSettled=1;
+	}
+	SpeedErrSum+=Err-(SpeedErrSum>>4);
+}
+#endif
+
+//Integral des Reglers lschen (Stillstand, Bremsen, Fehler)
+void SpeedReset(){
+	SpeedInt=0;
+}
+
+//Ein Schritt des Drehzahlreglers, Ausgang auf den Duty Cycle von M
+//Der Schritt gilt immer fr einen SysTick (feste Periode von TaskControl), eine verpasste Periode wird nicht
+//nachintegriert, sondern vom Scheduler gezhlt (Befehl 's')
+//PI mit Begrenzung auf SpeedOutMin..SpeedOutMax, Anti-Windup: das Integral bleibt innerhalb der Grenzen
+//und wird bei einem begrenzten Ausgang nur bernommen, wenn es aus der Begrenzung heraus fhrt
+//Die Rckfhrung gibt es nur fr Motor 1, die brigen Motoren werden gesteuert
+void SpeedControl(Motor_t * M, unsigned int Set){
+#if SpeedSource==SpeedSrcNone
+	SetDutyQ15(M, Set);
+#else
+	long Err;
+	long Int;
+	long Out;
+	if(M!=&Motor[0]){
+		SetDutyQ15(M, Set);
+		return;
+	}
+	SpeedSetQ15=Set;
+	SpeedActQ15=SpeedFeedback();
+	Err=(long)Set-SpeedActQ15;
+	SpeedMeasure(Err);
+	if(Set==0){
+		SpeedReset();
+		SetDutyQ15(M, 0);
+		return;
+	}
+	Int=SpeedInt+(long)SpeedKi*Err;
+	if(Int>((long)SpeedOutMax<<12)) Int=(long)SpeedOutMax<<12;
+	if(Int<((long)SpeedOutMin<<12)) Int=(long)SpeedOutMin<<12;
+	Out=((long)SpeedKp*Err+Int)>>12;
+	if(Out>(long)SpeedOutMax){
+		Out=SpeedOutMax;
+		if(Err<0) SpeedInt=Int;
+	}
+	else if(Out<(long)SpeedOutMin){
+		Out=SpeedOutMin;
+		if(Err>0) SpeedInt=Int;
+	}
+	else SpeedInt=Int;
+	SetDutyQ15(M, (unsigned int)Out);
+#endif
+}
+
+//Vergangene ms seit dem letzten Aufruf, SysTick wird in der ISR geschrieben
+unsigned int RampElapsed(){
+	unsigned int Now;
+	unsigned int Ms;
+	unsigned char Sreg;
+	Sreg=SREG;
+	cli();
+	Now=SysTick;
+	SREG=Sreg;
+	Ms=Now-RampTick;
+	RampTick=Now;
+	return Ms;
+}
+
+//bergang von Duty nach Target starten, die einzige Division der Rampe
+void ProfileStart(Motor_t * M, unsigned int Duty, unsigned int Target){
+	unsigned long Time;
+	unsigned int Step;
+	M->ProfStart=Duty;
+	M->ProfEnd=Target;
+	if(Duty<Target){
+		Time=Target-Duty;
+		Step=RampAccelStep;
+	}
+	else{
+		Time=Duty-Target;
+		Step=RampDecelStep;
+	}
+	Time=Time*pgm_read_byte(&ProfileSlope[RampProfile])/((unsigned long)Step<<4);	//Dauer in ms
+	if(Time==0) Time=1;
+	M->ProfStep=(Time>=65535)?1:65535/(unsigned int)Time;
+	M->ProfPhase=0;
+	M->ProfActive=1;
+}
+
+//Duty Cycle um Ms weiter entlang des Verlaufs an Target annhern
+//Pro Aufruf zwei Tabellenzugriffe und zwei 16x16-Multiplikationen
+unsigned int RampStep(Motor_t * M, unsigned int Target, unsigned int Ms){
+	unsigned long Phase;
+	unsigned char Idx;
+	unsigned int Lo;
+	int Diff;
+	if(M->ProfActive){
+		if(labs((long)Target-M->ProfEnd)>=ProfileRestart) ProfileStart(M, M->RampDutyQ15, Target);	//Neu ab dem aktuellen Duty Cycle
+	}
+	else{
+		if(M->RampDutyQ15==Target) return Target;
+		ProfileStart(M, M->RampDutyQ15, Target);
+	}
+	Phase=M->ProfPhase+(unsigned long)M->ProfStep*Ms;
+	if(Phase>=65535){
+		M->ProfActive=0;		//Eine kleine Restabweichung startet beim nchsten Aufruf einen neuen bergang
+		return M->ProfEnd;
+	}
+	M->ProfPhase=(unsigned int)Phase;
+	Idx=M->ProfPhase>>ProfileFracBits;
+	Lo=pgm_read_word(&ProfileTable[RampProfile][Idx]);
+	Diff=(int)(pgm_read_word(&ProfileTable[RampProfile][Idx+1])-Lo);
+	Lo+=(unsigned int)(((long)Diff*(M->ProfPhase&((1<<ProfileFracBits)-1)))>>ProfileFracBits);
+	return M->ProfStart+(int)(((long)(int)(M->ProfEnd-M->ProfStart)*(int)Lo)>>15);
+}
+
+//Rampe eines Motors sofort auf Stillstand setzen und bremsen
+void RampReset(Motor_t * M){
+	M->RampDutyQ15=0;
+	M->ProfActive=0;
+	M->RampState=RampRun;
+	M->OutDirection=DirBrake;
+	if(M==&Motor[0]) SpeedReset();
+	SetDutyQ15(M, 0);
+}
+
+//Alle Motoren auf Stillstand setzen (Fehlerabschaltung, Kalibrierung, Start)
+//Die bis hier vergangene Zeit wird verworfen
+void RampResetAll(){
+	unsigned char i;
+	for(i=0;i<MotorCount;i++) RampReset(&Motor[i]);
+	RampElapsed();
+}
+
+//Duty Cycle und Richtung an der Brcke eines Motors um Ms nachfhren
+//Der Duty Cycle folgt RampTargetQ15 entlang RampProfile, hchstens mit RampAccelStep bzw. RampDecelStep pro ms
+//Bei einem Richtungswechsel wird zuerst auf 0 verzgert, bei einer Umkehr Forward <-> Reverse
+//danach ReverseDwellMs gebremst und erst dann in der neuen Richtung beschleunigt
+void RampUpdate(Motor_t * M, unsigned int Ms){
+	unsigned int Target;
+	if(M->RampState==RampDwell){
+		if(Ms<M->RampDwellLeft){
+			M->RampDwellLeft-=Ms;
+			return;
+		}
+		M->RampState=RampRun;
+		M->OutDirection=M->Direction;
+	}
+	if((M->Direction!=M->OutDirection)&&(M->RampDutyQ15==0)){
+		if((M->Direction!=DirBrake)&&(M->OutDirection!=DirBrake)){
+			M->OutDirection=DirBrake;	//Umkehr: zuerst gebremst stehen
+			M->RampDwellLeft=ReverseDwellMs;
+			M->RampState=RampDwell;
+			return;
+		}
+		M->OutDirection=M->Direction;
+	}
+	Target=M->RampTargetQ15;
+	if((M->Direction!=M->OutDirection)||(M->OutDirection==DirBrake)) Target=0;
+	M->RampDutyQ15=RampStep(M, Target, Ms);
+	SpeedControl(M, M->RampDutyQ15);		//Ausgang der Rampe ist der Drehzahl-Sollwert
+}
+
+//Alle Motoren nachfhren, einmal pro SysTick wirksam
+void RampUpdateAll(){
+	unsigned int Ms;
+	unsigned char i;
+	Ms=RampElapsed();
+	if(Ms==0) return;
+	for(i=0;i<MotorCount;i++) RampUpdate(&Motor[i], Ms);
+}
+
+#ifdef MOTOR2
+//Vorgaben der Bedienung (Richtung, Geschwindigkeit) auf die folgenden Motoren der Station bertragen
+//Eigenstndige Motoren behalten ihre Vorgaben ber UART, im Modus Stop und nach einem Fehler werden sie gebremst
+//Jeder Motor fhrt seine eigene Rampe und Richtungsumkehr
+void MotorFollow(){
+	unsigned char i;
+	for(i=1;i<MotorCount;i++){
+		if(Motor[i].Follow){
+			Motor[i].Direction=Motor[0].Direction;
+			Motor[i].RampTargetQ15=Motor[0].RampTargetQ15;
+		}
+		else if((mode==ModeStop)||(mode==ModeFault)) Motor[i].Direction=DirBrake;
+	}
+}
+
+//Vorgabe fr Motor 2 ber UART, der Motor folgt danach nicht mehr Motor 1
+//Richtung nur ausserhalb von Stop und Fehler, der Sollwert wird auf 0..100% begrenzt
+unsigned char MotorCommand(unsigned char Cmd){
+	Motor_t * M=&Motor[1];
+	if((Cmd==MotorCmdForward)||(Cmd==MotorCmdReverse)){
+		if((mode==ModeStop)||(mode==ModeFault)) return 0;
+		M->Direction=(Cmd==MotorCmdForward)?DirForward:DirReverse;
+	}
+	if(Cmd==MotorCmdBrake) M->Direction=DirBrake;
+	if(Cmd==MotorCmdFaster) M->RampTargetQ15=(M->RampTargetQ15>32768-MotorCmdStep)?32768:M->RampTargetQ15+MotorCmdStep;
+	if(Cmd==MotorCmdSlower) M->RampTargetQ15=(M->RampTargetQ15<MotorCmdStep)?0:M->RampTargetQ15-MotorCmdStep;
+	M->Follow=(Cmd==MotorCmdFollow);
+	return 1;
+}
+#endif
+
+#ifdef MOTORFAULT
+//Komparator fr die Fehlerabschaltung einrichten
+//Die Flanke wird zustzlich als Input Capture von Timer1 erfasst, damit die ISR die Auslsezeit messen kann
+void FaultInit(){
+	GPIOR0&=~(1<<FaultBit);
+#if defined(PWMHARDWARE)||defined(TACHO)
+	//Timer1 ist die PWM mit TOP in ICR1 bzw. der Input Capture gehrt dem Drehzahlgeber, die Zeitmessung steht nicht zur Verfgung
+#if FaultRef==FaultRefVbg
+	adc_Init_Comp(ADC_COMP_NINV_VBG, ADC_COMP_INV_AIN1, ADC_COMP_INT_RISING);
+#else
+	adc_Init_Comp(ADC_COMP_NINV_AIN0, ADC_COMP_INV_AIN1, ADC_COMP_INT_FALLING);
+#endif
+#else
+	TCCR1A=0;
+	TCCR1B=(1<<CS10);	//Timer1 ohne Prescaler als Zeitbasis, 62.5ns Auflsung
+#if FaultRef==FaultRefVbg
+	TCCR1B|=(1<<ICES1);	//Ausgang des Komparators steigt, wenn AIN1 unter die Bandgap fllt
+	adc_Init_Comp(ADC_COMP_NINV_VBG, ADC_COMP_INV_AIN1, ADC_COMP_INT_RISING+ADC_COMP_INT_CAPT);
+#else
+	adc_Init_Comp(ADC_COMP_NINV_AIN0, ADC_COMP_INV_AIN1, ADC_COMP_INT_FALLING+ADC_COMP_INT_CAPT);
+#endif
+#endif
+}
+
+//berwachte Spannung liegt noch unter der Schwelle
+unsigned char FaultActive(){
+#if FaultRef==FaultRefVbg
+	return adc_Get_Comp();
+#else
+	return !adc_Get_Comp();
+#endif
+}
+
+//Gespeicherten Fehler behandeln: der Motor bleibt gebremst, bis im Modus Stop quittiert wird
+//und die Spannung wieder ber der Schwelle liegt
+void FaultHandle(){
+	if(!MotorFault) return;
+	if((mode==ModeStop)&&!FaultActive()){
+		GPIOR0&=~(1<<FaultBit);
+		LED_Red_Off;
+		return;
+	}
+	mode=ModeFault;
+	Motor[0].Direction=DirBrake;
+	RampResetAll();		//Nach dem Quittieren wieder aus dem Stillstand beschleunigen
+	LED_Green_Off;
+	LED_Red_On;
+}
+#endif
+
+#ifdef CURRENTLIMIT
+//Komparator fr die Strombegrenzung einrichten, Interrupt beim berschreiten der Grenze
+void CurLimInit(){
+#if FaultRef==FaultRefVbg
+	adc_Init_Comp(ADC_COMP_NINV_VBG, ADC_COMP_INV_AIN1, ADC_COMP_INT_FALLING);
+#else
+	adc_Init_Comp(ADC_COMP_NINV_AIN0, ADC_COMP_INV_AIN1, ADC_COMP_INT_RISING);
+#endif
+}
+
+//Anzahl gekrzter Perioden lesen und zurcksetzen
+unsigned int CurLimGetCount(){
+	unsigned int Count;
+	unsigned char Sreg;
+	Sreg=SREG;
+	cli();
+	Count=CurLimCount;
+	CurLimCount=0;
+	SREG=Sreg;
+	return Count;
+}
+#endif
+
+//Umrechnung der Messkanle in mV an die gemessene Vcc anpassen
+//Ohne Spannungsteiler ist der Vollausschlag gleich Vcc, adc_Init_mV_Scale braucht dann keine Division
+void MeasureScaleUpdate(){
+	if(VccMilliVolt==MeasureScaleVcc) return;
+	MeasureScaleVcc=VccMilliVolt;
+	adc_Init_mV_Scale(&MeasureScale, VccMilliVolt, 0, 0, 10+MeasureOsrBits);
+}
+
+void timer0_init() {
+	// Set timer0 to fast PWM mode (TOP 0xFF), compare outputs disconnected
+	// Gleiche Periode wie im Normal-Modus, aber OCR0A/OCR0B werden erst bei BOTTOM bernommen
+	TCCR0A &= ~((1<<COM0A1) | (1<<COM0A0) | (1<<COM0B1) | (1<<COM0B0));
+	TCCR0A |= (1<<WGM01) | (1<<WGM00);
+	TCCR0B &= ~(1<<WGM02);
+
+	// Enable compare match B interrupt (Compare A triggert nur den ADC, ohne Interrupt)
+	TIMSK0 |= (1<<OCIE0B);
+	// Enable timer overflow interrupt
+	TIMSK0 |= (1<<TOIE0);
+
+	// Set the initial value for OCR0B (the compare match register) and the ADC sample point
+	OCR0B = 0xFF;
+	OCR0A = 0xFF;
+
+	// Set the prescaler to 8 (0.5us per step, 128us PWM period)
+	TCCR0B |= (1<<CS01);
+
+	// Enable global interrupts
+	sei();
+}
+
+#ifdef MOTOR2
+//Timer2 fr Motor 2 im selben Modus wie Timer0 (Fast PWM, Prescaler 8, 128us), Compare B schaltet die Ein-Phase
+//Beide Prescaler werden angehalten (TSM), die Zhler mit dem Versatz Motor2Phase gesetzt und gemeinsam freigegeben
+void timer2_init() {
+	unsigned char Sreg;
+	TCCR2A = (1<<WGM21) | (1<<WGM20);
+	OCR2B = 0xFF;
+	OCR2A = 0xFF;
+	Sreg = SREG;
+	cli();
+	GTCCR = (1<<TSM) | (1<<PSRASY) | (1<<PSRSYNC);
+	TCCR2B = (1<<CS21);
+	TCNT0 = 0;
+	TCNT2 = Motor2Phase;
+	TIFR2 = (1<<OCF2B) | (1<<TOV2);
+	TIMSK2 = (1<<OCIE2B) | (1<<TOIE2);
+	GTCCR = 0;
+	SREG = Sreg;
+}
+#endif
@@ -13,23 +13,182 @@
 
 #include <avr/io.h>
 
+//Messwerte aus dem zuletzt gelesenen Snapshot als 8-Bit Wert (für Kanäle ohne Oversampling)
+#define AdcValue8(ScanId) (unsigned char)(AdcSnapshot.Value[ScanId]>>2)
+
+//Ausgänge der Brücke, alle Pins müssen am selben Port liegen (MOTOR_PORT)
+//Zustände der beiden Eingänge der Brücke (Enable = 1):
+//  Forward Reverse  Brücke
+//     1       1     Brake (Kurzschlussbremse, Aus-Phase der PWM)
+//     1       0     Forward (Ein-Phase)
+//     0       1     Reverse (Ein-Phase)
+//Die Richtungs-Makros sind einzelne Ausdrücke und schreiben beide Pins mit einem einzigen Zugriff,
+//es entsteht kein Zwischenzustand (z.B. 0/0 oder die falsche Richtung für einige Takte)
+//Gelesen und geschrieben wird ohne Interrupt-Sperre: ausserhalb einer ISR nur mit gesperrten Interrupts verwenden
+#define MOTOR_PORT PORTB
+#define MOTOR_DDR DDRB
+#ifdef PWMHARDWARE
+//Hardware-PWM auf Timer1 (Symbol PWMHARDWARE): Forward an OC1A (PB1), Reverse an OC1B (PB2), Enable an PB0
+//Der Pin der Gegenrichtung wird gepulst: Ein-Phase = Forward bzw. Reverse, Aus-Phase = Brake
+//Die Richtung wird nur über die Compare-Output-Modes gewählt, es braucht keine PWM-Interrupts
+//PORTB hält beide Pins dauernd auf 1, ohne Compare-Ausgang gilt also Brake
+//  Richtung  OC1A (PB1)     OC1B (PB2)
+//  Forward   PORTB = 1      PWM, 0 in der Ein-Phase um BOTTOM
+//  Reverse   PWM            PORTB = 1
+//  Brake     PORTB = 1      PORTB = 1
+#define MOTOR_Reverse (1<<PB2)
+#define MOTOR_Forward (1<<PB1)
+#define MOTOR_Enable (1<<PB0)
+#define PwmComMask ((1<<COM1A1)|(1<<COM1A0)|(1<<COM1B1)|(1<<COM1B0))
+#define PwmOut(Com) (TCCR1A=(TCCR1A&~PwmComMask)|(Com))	//Compare-Ausgänge mit einem Schreibzugriff umschalten
+#define Forward PwmOut((1<<COM1B1)|(1<<COM1B0))
+#define Reverse PwmOut((1<<COM1A1)|(1<<COM1A0))
+#define Brake PwmOut(0)
+#else
+//Software-PWM auf Timer0: die Compare B ISR schaltet die Ein-Phase, die Überlauf-ISR Brake (DriveBrake)
+//8 Bit bei 7.8kHz, die 16-Bit PWM mit wählbarer Frequenz gibt es mit PWMHARDWARE (siehe PwmFreqDefault)
+//  Phase                 Forward        Reverse
+//  Überlauf .. OCR0B     1/1 Brake      1/1 Brake
+//  OCR0B .. Überlauf     1/0 Forward    0/1 Reverse
+//Pro Flanke ändert nur ein Pin, ein Durchschalten der Gegenrichtung ist nicht möglich
+#ifdef TACHO
+//Mit Drehzahlgeber (Symbol TACHO) ist PB0 der Eingang ICP1, Reverse und Enable müssen umverdrahtet werden
+#define MOTOR_Reverse (1<<PB2)
+#define MOTOR_Forward (1<<PB1)
+#define MOTOR_Enable (1<<PB3)
+#else
 #define MOTOR_Reverse (1<<PB0)
 #define MOTOR_Forward (1<<PB1)
-#define MOTOR_Enable (1<<PB2)
-#define Forward (PORTB |= MOTOR_Forward); (PORTB &= ~MOTOR_Reverse)
-#define Reverse (PORTB|=MOTOR_Reverse); (PORTB&=~MOTOR_Forward)
-#define Enable (PORTB|=MOTOR_Enable)
-#define Brake (PORTB|=MOTOR_Forward|MOTOR_Reverse)
+#define MOTOR_Enable (1<<PB2)
+#endif
+#define Forward MotorOut(OutForward)
+#define Reverse MotorOut(OutReverse)
+#define Brake MotorOut(OutBrake)
+#endif
+#define MOTOR_Bridge (MOTOR_Forward|MOTOR_Reverse)
+#define OutForward MOTOR_Forward
+#define OutReverse MOTOR_Reverse
+#define OutBrake MOTOR_Bridge
+#define MotorOut(State) (MOTOR_PORT=(MOTOR_PORT&~MOTOR_Bridge)|(State))	//Beide Eingänge der Brücke in einem Zugriff setzen
+#define Enable (MOTOR_PORT|=MOTOR_Enable)
 
-#define LED_Red (1<<PD6)
+//Zweiter Motor (Symbol MOTOR2): eigene Brücke an PB4/PB5, Enable an PC4, Software-PWM auf Timer2
+//Timer2 läuft mit der selben Periode wie Timer0 (Prescaler 8, 128us), beide werden gemeinsam gestartet,
+//Timer2 um Motor2Phase versetzt, damit die ISRs der beiden Motoren nicht zusammenfallen
+//Drehzahlrückführung (BEMF, TACHO) und Strombegrenzung gibt es nur für Motor 1, MOTORFAULT bremst beide
+//Rechenzeit pro PWM-Periode (2048 Takte), abgeschätzt aus den Befehlsfolgen, nicht gemessen:
+//  Motor 1: Compare B ca. 60, Überlauf ca. 70 Takte (mit SysTick), zusammen ca. 6%
+//  Motor 2: Compare B ca. 60, Überlauf ca. 45 Takte, zusammen ca. 5%
+//  Rampe pro Motor und ms (16000 Takte) ca. 300 Takte, ca. 2%
+//  Zwei Motoren zusammen ca. 15% der CPU, ohne ADC und UART
+//Messung am Board: Befehl 'l' mit und ohne MOTOR2, der Anteil der ISRs von Motor 2 ist 1 - Rate mit / Rate ohne,
+//die Rampe von Motor 2 zeigt sich in der Laufzeit von TaskControl (Befehl 's')
+#ifdef MOTOR2
+#ifdef PWMHARDWARE
+#error "MOTOR2 braucht die Software-PWM auf Timer0 und Timer2"
+#endif
+#define MotorCount 2
+#define MOTOR2_PORT PORTB
+#define MOTOR2_DDR DDRB
+#define MOTOR2_Forward (1<<PB4)
+#define MOTOR2_Reverse (1<<PB5)
+#define MOTOR2_Bridge (MOTOR2_Forward|MOTOR2_Reverse)
+#define MOTOR2_EN_PORT PORTC
+#define MOTOR2_EN_DDR DDRC
+#define MOTOR2_Enable (1<<PC4)
+#define Enable2 (MOTOR2_EN_PORT|=MOTOR2_Enable)
+#define Motor2Phase 128		//Versatz von Timer2 gegenüber Timer0 in Timer-Schritten (halbe Periode)
+#else
+#define MotorCount 1
+#endif
+#define MotorCmdStatus 'd'	//UART-Befehl: pro Motor eine Zeile mit Richtung an der Brücke, Duty Cycle, Sollwert (Q15)
+							//und Vorgabe (F: folgt Motor 1, E: eigene Vorgaben)
+//Die Bedienung (Schalter, Potis, mode und stopped) gibt es nur für Motor 1. Motor 2 folgt ihm nach dem Start
+//(MotorFollow überträgt Richtung und Sollwert), mit den Befehlen unten wird er eigenständig über UART gesteuert.
+//Eigene Rampe, Richtungsumkehr, Betriebsart und Compare-Kanal hat jeder Motor in Motor_t, die Drehzahlregelung
+//gibt es nur für Motor 1. Im Modus Stop und nach einem Fehler bremst auch ein eigenständiger Motor 2
+#define MotorCmdForward '+'	//UART-Befehle für Motor 2, Bestätigung mit dem Zeichen: eigenständig Forward fahren
+#define MotorCmdReverse '-'	//Eigenständig Reverse fahren
+#define MotorCmdBrake '='	//Eigenständig bremsen
+#define MotorCmdFaster '>'	//Eigenständig, Sollwert um MotorCmdStep erhöhen
+#define MotorCmdSlower '<'	//Eigenständig, Sollwert um MotorCmdStep verringern
+#define MotorCmdFollow '*'	//Wieder Motor 1 folgen
+#define MotorCmdStep 2048	//Schritt des Sollwerts (1/16 von 100%)
+
+//Bremsen eines Motors über die Instanz (Motor_t), unabhängig von der Betriebsart (Fehlerabschaltung)
+//Beide Eingänge auf 1 in einem Zugriff, danach Enable ein, sonst bliebe die Brücke in der Aus-Phase von DriveCoast im Freilauf
+#define MotorBrake(M) (*(M)->Port|=(M)->PinForward|(M)->PinReverse, *(M)->EnPort|=(M)->PinEnable)
+
+//Betriebsart der Software-PWM pro Motor, bestimmt die Aus-Phase:
+//  DriveBrake      Aus-Phase Brake (1/1), langsames Abklingen des Stroms über die Kurzschlussbremse
+//  DriveCoast      Aus-Phase Enable aus, schnelles Abklingen über die Freilaufdioden gegen die Versorgung
+//  DriveAntiphase  Locked-Antiphase: Ein-Phase Forward, Aus-Phase Reverse, die Brücke ist dauernd aktiv
+//                  Die Richtung steckt im Duty Cycle: 50% = Stillstand, darüber Forward, darunter Reverse
+//Bei DirBrake (Stillstand, Richtungsumkehr) wird in allen Betriebsarten gebremst
+//Die Strombegrenzung wirkt bei DriveAntiphase in beiden Phasen, gekürzt wird mit Brake bis zur nächsten Flanke
+//Mit PWMHARDWARE gibt es nur DriveBrake
+#define DriveBrake 0
+#define DriveCoast 1
+#define DriveAntiphase 2
+#define DriveCount 3
+#ifndef DriveDefault
+#define DriveDefault DriveBrake
+#endif
+#if defined(PWMHARDWARE)&&(DriveDefault!=DriveBrake)
+#error "PWMHARDWARE: nur DriveBrake, DriveCoast und DriveAntiphase gibt es nur mit der Software-PWM"
+#endif
+#define DriveAvgBits 6		//Mittelung der Messwerte für den Vergleich der Betriebsarten (EMA über ca. 64 Snapshots)
+#define DriveCmdNext 'b'	//UART-Befehl: nächste Betriebsart für alle Motoren, Bestätigung mit 'B' und der Nummer
+#define DriveCmdStat 'e'	//UART-Befehl: Betriebsart, Vcc, Messkanal 1 und 2 am ADC-Pin gemittelt in mV, Duty Cycle von Motor 1
+
+//Fehlerabschaltung über den Komparator (Symbol MOTORFAULT)
+//Die überwachte Spannung muss über einen Teiler an einen Komparator-Eingang geführt werden:
+//FaultRefVbg: Messspannung an AIN1 (PD7), Auslösung unter der Bandgap (1.1V)
+//FaultRefAin1: Messspannung an AIN0 (PD6), Auslösung unter der Referenz an AIN1 (PD7)
+//Die LEDs an diesen Pins stehen dann nicht zur Verfügung
+#define FaultRefVbg 1
+#define FaultRefAin1 2
+#ifndef FaultRef
+#define FaultRef FaultRefVbg
+#endif
+
+//Strombegrenzung pro PWM-Periode über den Komparator (Symbol CURRENTLIMIT)
+//Die Spannung am Shunt wird wie bei MOTORFAULT an AIN1 (FaultRefVbg, Grenze 1.1V) bzw. an AIN0
+//mit der Grenze an AIN1 (FaultRefAin1) geführt. Überschreitet sie die Grenze, endet die Ein-Phase
+//sofort (Brake), die nächste Periode beginnt wieder normal. Liegt der Strom beim Einschalten noch
+//über der Grenze, wird die Phase ausgelassen
+//Eine Flanke in der Austastzeit (CurLimBlank) wird ignoriert und danach nicht nachgeprüft: steigt der
+//Strom schon dort über die Grenze, läuft diese Phase ganz, erst die nächste wird ausgelassen
+#if defined(MOTORFAULT) && defined(CURRENTLIMIT)
+#error "MOTORFAULT und CURRENTLIMIT brauchen beide den Komparator"
+#endif
+#if FaultRef==FaultRefVbg
+#define CurLimOver (!(ACSR&(1<<ACO)))	//Shunt über der Bandgap
+#else
+#define CurLimOver (ACSR&(1<<ACO))		//Shunt an AIN0 über der Grenze an AIN1
+#endif
+#define CurLimBlank 4		//Software-PWM: Flanken in den ersten 2us der Ein-Phase ignorieren (Einschaltspitze)
+#define CurLimCmdCount 'c'	//UART-Befehl: Anzahl gekürzter Perioden senden und zurücksetzen
+
+#if defined(MOTORFAULT) || defined(CURRENTLIMIT)
+#define LED_Green 0		//PD7 ist AIN1
+#else
 #define LED_Green (1<<PD7)
+#endif
+#if (defined(MOTORFAULT) || defined(CURRENTLIMIT)) && (FaultRef==FaultRefAin1)
+#define LED_Red 0		//PD6 ist AIN0
+#else
+#define LED_Red (1<<PD6)
+#endif
 #define LED_Green_On (PORTD|=LED_Green)
 #define LED_Green_Off (PORTD&=~LED_Green)
 #define LED_Red_On (PORTD|=LED_Red)
 #define LED_Red_Off (PORTD&=~LED_Red)
 
 #define SpeedChannel ADC_CH_3
-#define SetSpeed DutyCycle = adc_Read_8(SpeedChannel)
+#define SpeedScanId 3	//ScanId = Index in der Scan-Tabelle (main.c)
+#define SpeedQ15 ((unsigned int)(1023-AdcSnapshot.Value[SpeedScanId])<<5)	//Poti mit vollen 10 Bit, Anschlag oben = Stillstand wie bisher
+#define SetSpeed (Motor[0].RampTargetQ15=SpeedQ15)	//Sollwert der Rampe, der Duty Cycle folgt mit RampUpdate
 
 
 #define DirForward 0x01
@@ -39,6 +198,7 @@
 #define ModeMan 0x01
 #define ModeAuto 0x02
 #define ModeStop 0x03
+#define ModeFault 0x04
 
 #define CCW (1<<PD4)
 #define CW (1<<PD5)
@@ -47,75 +207,366 @@
 #define AUTO (1<<PD2)
 
 #define SwitchChannel ADC_CH_2
-#define Schwellwert (char)(76+(adc_Read_8(SwitchChannel)*0.4))
+#define SwitchScanId 2
+#define Schwellwert (unsigned int)(1216+((AdcSnapshot.Value[SwitchScanId]*8)/5))	//12 Bit: (76+Poti*0.4)*16
 
 #define MeasureChannel1 ADC_CH_0
 #define MeasureChannel2 ADC_CH_1
-#define MeasureChannel1Value adc_Read_8(MeasureChannel1)
-#define MeasureChannel2Value adc_Read_8(MeasureChannel2)
-#define untererSchwellwert 50
+#define MeasureScanId1 0
+#define MeasureScanId2 1
+#define MeasureOsrBits 2	//Messkanäle mit 12 Bit (16-faches Oversampling)
+#define MeasureChannel1Value AdcSnapshot.Value[MeasureScanId1]
+#define MeasureChannel2Value AdcSnapshot.Value[MeasureScanId2]
+#define untererSchwellwert_mV 977	//Spannung am ADC-Pin bei 10V (50 von 255 bei 5V), Vergleich in mV ohne Division
+#define MeasureMilliVolt(Value) adc_Scale_mV(&MeasureScale, Value)	//12-Bit Wert der Messkanäle in mV am ADC-Pin
+#define MvCmdBench 'v'		//UART-Befehl (nur Modus Stop): Takte pro Umrechnung in mV mit Division und mit adc_Scale_mV
+#define MvBenchN 16			//Anzahl gemessener Umrechnungen pro Verfahren
+
+#define VbgScanId 4		//Bandgap zur Messung von Vcc
 
-#define DutyCycle OCR0A
+#define DutyCycle OCR0B		//Compare B schaltet den Motor ein (Ende der Aus-Phase)
+#define SamplePoint OCR0A	//Compare A startet die ADC-Wandlung (PWM-synchron)
+#define DutyCycleMin 1		//Compare B bei 0 fiele mit dem Überlauf zusammen, die Überlauf-ISR würde sofort wieder bremsen
+#define SampleMid(Duty) (128+((Duty)>>1))	//Abtastzeitpunkt in der Mitte der Ein-Phase
 
 #define Stop 0x02
 #define Go 0x01
 
-volatile unsigned char direction = 0;
-volatile unsigned char mode = 0;
-volatile unsigned char stopped = Go;
+//Einschränkungen von PWMHARDWARE: andere Belegung von PORTB (Reverse an OC1B/PB2, Enable an PB0, die Platine muss
+//dafür angepasst werden), kein MOTOR2, TACHO oder SpeedSrcBemf, und nur die Betriebsart DriveBrake
+#define PwmFreqDefault 20000	//PWM-Frequenz in Hz beim Start (PWMHARDWARE), unhörbar
+#define PwmCmdFreq '1'		//UART-Befehle '1'..'5': PWM-Frequenz aus PwmFreqTable wählen, Bestätigung mit der Ziffer
+#define PwmTopMin 100		//Mindestauflösung der PWM in Schritten (höchstens 80kHz)
+#define PwmTicksPerMsT0 8	//PWM-Perioden von Timer0 pro SysTick (128us, SysTick = 1.024ms)
+
+#define RampAccelMs 500		//Beschleunigung: Zeit von Stillstand bis 100% in ms
+#define RampDecelMs 300		//Verzögerung: Zeit von 100% bis Stillstand in ms
+#define ReverseDwellMs 50	//Richtungsumkehr: Bremszeit bei Duty 0 in ms, bevor in der neuen Richtung angefahren wird
+#define RampRun 0			//Zustände der Rampe: Duty Cycle folgt dem Sollwert
+#define RampDwell 1			//Richtungsumkehr, Motor steht gebremst
+
+//Verlauf der Rampe: jeder Übergang folgt einer Kurve aus ProfileTable (Flash), linear interpoliert
+//Die Dauer richtet sich nach der Grösse der Änderung und der steilsten Stelle der Kurve (ProfileSlope),
+//so dass RampAccelStep bzw. RampDecelStep pro ms auch beim S-Verlauf nirgends überschritten werden
+#define ProfileLinear 0		//Konstante Steigung
+#define ProfileSCurve 1		//S-Verlauf (1-cos), weicher Anlauf und weiches Erreichen des Sollwerts
+#define ProfileExp 2		//Exponentiell (1-e^-5x), schneller Anlauf und langsames Annähern
+#define ProfileCount 3
+#ifndef ProfileDefault
+#define ProfileDefault ProfileSCurve
+#endif
+#define ProfileBits 5		//32 Abschnitte, 33 Stützstellen pro Kurve
+#define ProfileFracBits (16-ProfileBits)	//Bits des Fortschritts zwischen zwei Stützstellen
+#define ProfileRestart 328	//Sollwertänderung, die einen laufenden Übergang neu startet (1%), kleinere werden am Ende übernommen
+#define ProfileCmdNext 'p'	//UART-Befehl: nächsten Verlauf wählen, Bestätigung mit 'P' und der Nummer
+
+//Kalibrierwerte der Drehzahlregelung, für jeden Motor und jede Platine zu bestimmen
+//Die Werte hier sind nicht am Motor ermittelt, jeder kann als Symbol im Projekt überschrieben werden
+#ifndef SpeedKpDefault
+#define SpeedKpDefault 2048	//Proportionalbeiwert in Q12 (0.5)
+#endif
+#ifndef SpeedKiDefault
+#define SpeedKiDefault 82	//Integralbeiwert pro SysTick in Q12 (0.02, Nachstellzeit ca. 25ms)
+#endif
+#ifndef MotorSupply_mV
+#define MotorSupply_mV 12000	//Versorgung der Brücke = Gegen-EMK bei Leerlauf und 100% Duty Cycle (SpeedSrcBemf)
+#endif
+#ifndef BemfDivider_mV
+#define BemfDivider_mV 977	//Spannung am ADC-Pin bei 10V an der Motorklemme, Teiler der Messeingänge (SpeedSrcBemf)
+#endif
+#ifndef TachPulsesPerRev
+#define TachPulsesPerRev 1	//Impulse des Drehzahlgebers pro Umdrehung (SpeedSrcTach)
+#endif
+#ifndef TachRpmMax
+#define TachRpmMax 3000		//Leerlaufdrehzahl bei 100% Duty Cycle in U/min, entspricht 32768 (SpeedSrcTach)
+#endif
+
+//Drehzahlregler (PI), läuft in TaskControl mit der festen Periode von einem SysTick, Sollwert ist der Ausgang der Rampe
+//Drehzahlen und Duty Cycle in Q15: 32768 = Leerlaufdrehzahl bei 100% Duty Cycle
+//Die Verstärkungen sind bewusst Q12 statt Q15: so passen Werte bis 8 in ein int und alle Produkte in 32 Bit
+//Standard ist die Steuerung ohne Rückführung. Die Regelung wird mit dem Symbol SpeedSource gewählt,
+//erst nachdem die Kalibrierwerte oben für die Hardware bestimmt sind
+#define SpeedSrcNone 0		//Keine Rückführung: der Sollwert geht direkt auf den Duty Cycle (Steuerung wie bisher)
+#define SpeedSrcBemf 1		//Gegen-EMK an den Messkanälen, gemessen in der Aus-Phase (Software-PWM, ADCINJECT)
+#define SpeedSrcTach 2		//Drehzahlgeber an ICP1 (TACHO)
+#ifndef SpeedSource
+#define SpeedSource SpeedSrcNone
+#endif
+#if (SpeedSource!=SpeedSrcNone)&&(SpeedSource!=SpeedSrcBemf)&&(SpeedSource!=SpeedSrcTach)
+#error "SpeedSource: unbekannte Drehzahlquelle"
+#endif
+#if (SpeedSource==SpeedSrcBemf)&&(defined(PWMHARDWARE)||!defined(ADCINJECT))
+#error "SpeedSrcBemf braucht die Software-PWM und das Symbol ADCINJECT"
+#endif
+#if (SpeedSource==SpeedSrcTach)&&!defined(TACHO)
+#error "SpeedSrcTach braucht das Symbol TACHO"
+#endif
+#if defined(TACHO)&&defined(PWMHARDWARE)
+#error "TACHO: bei PWMHARDWARE ist ICR1 das TOP von Timer1, der Input Capture steht nicht zur Verfügung"
+#endif
+#define SpeedOutMinDefault 0
+#define SpeedOutMaxDefault 32768
+#define SpeedSettleBand 328	//Toleranzband für die Einschwingzeit (1%)
+#define SpeedCmdStatus 'r'	//UART-Befehl: Einschwingzeit in ms und mittlere Regelabweichung (Q15) senden
+
+//Gegen-EMK (SpeedSrcBemf): in jeder BemfPeriods-ten Periode läuft der Motor in der Aus-Phase frei (Enable aus)
+//Compare A wandelt dann statt eines Scan-Eintrags einen Messkanal, abwechselnd Kanal 1 und 2.
+//Im Freilauf liegt die Gegen-EMK zwischen den Klemmen, die Drehzahl ist Gegen-EMK / Versorgung
+//Zeiten in Timer0-Schritten zu 0.5us ab Beginn der Aus-Phase
+#define BemfPeriods 16		//Messung alle 16 Perioden (ca. 2ms)
+#define BemfSampleCnt 120	//Abtastung nach 60us: der Strom ist abgeklungen und die Wandlung der Vorperiode (bis 56us) ist fertig
+#define BemfOnMin (BemfSampleCnt+16)	//Ein-Phase der Messperiode frühestens 8us nach dem Abtasten (Sample & Hold)
+#define BemfFiltBits 2		//EMA der Drehzahl, y = y + (x-y)/4
+#define BemfIdle 0			//Zustand der Messung: keine Messperiode gepuffert
+#define BemfArmed 1			//Die nächste Periode ist eine Messperiode
+#define BemfFullScale (unsigned int)((((unsigned long)MotorSupply_mV*BemfDivider_mV/10000)<<10)/VccMilliVolt)	//Gegen-EMK bei Leerlauf in 10 Bit
+
+//Drehzahlgeber an ICP1 (Symbol TACHO): Timer1 läuft frei mit Prescaler 8, jede steigende Flanke wird
+//per Input Capture mit 0.5us Auflösung gestempelt, Überläufe erweitern den Zeitstempel auf 32 Bit
+#define TachClockHz (F_CPU/8)
+#define TachAvgBits 3		//Mittelung über 2^3 Perioden
+#define TachTimeoutMs 250	//Ohne Flanke in dieser Zeit gilt der Motor als stillstehend (unter 240 U/min bei 1 Impuls)
+#define TachTimeout ((unsigned long)TachClockHz/1000*TachTimeoutMs)	//in Timer-Schritten
+#define TachRpmQ4Const ((unsigned long)TachClockHz*60*16/TachPulsesPerRev)	//Drehzahl in 1/16 U/min = Konstante / Periode
+#define TachCmdRpm 'n'		//UART-Befehl: Drehzahl in U/min und Zeitstempel der letzten Flanke senden
+
+#define CaptPreTrig (ADC_CAPT_LEN/2)	//Hälfte der Aufzeichnung vor dem Trigger
+#define CaptExclusive 0		//1: während der Aufzeichnung nur die Messkanäle wandeln (Potis werden nicht aktualisiert)
+#define CaptCmdTrigger 't'	//UART-Befehl: Aufzeichnung scharf schalten und sofort auslösen
+#define CaptCmdArm 'a'		//UART-Befehl: Aufzeichnung scharf schalten, der nächste Richtungswechsel löst aus, Bestätigung mit 'A'
+
+#define CalCmdZero 'z'		//UART-Befehl: Nullpunkt der Messkanäle übernehmen (beide Eingänge auf 0V)
+#define CalCmdGain 'g'		//UART-Befehl: Verstärkung der Messkanäle bestimmen (beide Eingänge auf Referenzspannung)
+#define CalCmdSave 'w'		//UART-Befehl: Kalibrierung im EEPROM speichern
+#define CalError '?'		//Antwort bei Fehler, sonst wird der Befehl als Grossbuchstabe bestätigt
+#define FaultCmdLatency 'f'	//UART-Befehl: Auslösezeit der letzten Fehlerabschaltung senden
+#define FaultBit 0			//Fehler-Flag in GPIOR0, mit sbi/sbis in einem Takt erreichbar
+#define MotorFault (GPIOR0&(1<<FaultBit))
+
+#define CalRef_mV 977		//Referenzspannung am ADC-Pin für die Verstärkung (10V am Eingang)
+#define CalSnapshots 64		//Anzahl Snapshots für die Mittelung, ca. 25ms verteilt auf die SysTicks von TaskControl
+#define CaptSync1 0xA5		//Startkennung der Ausgabe
+#define CaptSync2 0x5A
+#define CaptHeaderLen 6		//Sync, Anzahl Werte, Anzahl Werte vor dem Trigger
+#define TxBufLen 128		//Sendepuffer der Antworten in Byte, Zweierpotenz, grösser als die längste Antwort
+
+//Kooperativer Scheduler mit festen Perioden in SysTick (ms), die Aufgaben stehen in SchedTable (main.c)
+//Pro Durchlauf läuft die fällige Aufgabe mit der höchsten Priorität (kleinster Index) bis zum Ende
+//Die Laufzeit wird mit Timer0 gemessen (0.5us, bei PWMHARDWARE eine PWM-Periode)
+#define SchedTaskMax 4		//Grösste Anzahl Aufgaben
+#define SchedCmdReport 's'	//UART-Befehl: pro Aufgabe Periode, Budget, letzte und grösste Laufzeit in us,
+							//Überschreitungen des Budgets und verpasste Perioden senden, danach zurücksetzen
+#define LoopCmdRate 'l'		//UART-Befehl: Durchläufe der Hauptschleife pro Sekunde im letzten Messfenster senden
+#define LoopWindowMs 1000	//Messfenster der Schleifenrate, Periode von TaskLoop
+
+//Ein Motor mit eigener Brücke, eigenem Compare-Kanal und eigener Rampe
+typedef struct
+{
+	volatile unsigned char * Port;	//Port der beiden Eingänge der Brücke
+	unsigned char PinForward;		//Pin Forward der Brücke
+	unsigned char PinReverse;		//Pin Reverse der Brücke
+	volatile unsigned char * EnPort;	//Port des Enable der Brücke
+	unsigned char PinEnable;		//Pin Enable der Brücke
+	unsigned char Drive;			//Betriebsart (DriveBrake, DriveCoast, DriveAntiphase)
+	unsigned char Follow;			//1: Richtung und Sollwert von Motor 1 übernehmen (MotorFollow)
+	volatile unsigned char * DutyReg;	//Compare-Register, das die Ein-Phase startet (Software-PWM)
+	volatile unsigned char * SampleReg;	//Compare-Register für den Abtastzeitpunkt, nur Timer0 triggert den ADC
+	volatile unsigned char Direction;	//Verlangte Richtung (Hauptprogramm)
+	volatile unsigned char OutDirection;	//Richtung an der Brücke, folgt Direction über die Rampe
+	unsigned char Duty8;			//DutyCycle der Software-PWM, das Compare-Register weicht in Messperioden davon ab
+	unsigned int DutyQ15;			//Duty Cycle am Ausgang, 32768 = 100%
+	unsigned int RampTargetQ15;		//Sollwert des Duty Cycle
+	unsigned int RampDutyQ15;		//Duty Cycle der Rampe
+	unsigned int RampDwellLeft;		//Verbleibende Bremszeit bei der Richtungsumkehr in ms
+	unsigned char RampState;
+	unsigned char ProfActive;		//Ein Übergang läuft
+	unsigned int ProfStart;			//Duty Cycle beim Start des Übergangs
+	unsigned int ProfEnd;			//Duty Cycle am Ende des Übergangs
+	unsigned int ProfPhase;			//Fortschritt des Übergangs, 65536 = fertig
+	unsigned int ProfStep;			//Fortschritt pro ms
+} Motor_t;
 
+//Eine Aufgabe des Schedulers (Tabelle im Flash)
+typedef struct
+{
+	void (*Func)(void);			//Aufgabe, läuft ohne zu blockieren bis zum Ende
+	unsigned int PeriodMs;		//Periode in SysTick
+	unsigned int BudgetUs;		//Erlaubte Laufzeit in us
+} SchedTask_t;
+
+//Zustand und Statistik einer Aufgabe
+typedef struct
+{
+	unsigned int Next;			//SysTick des nächsten Starts
+	unsigned int LastUs;		//Letzte Laufzeit in us
+	unsigned int MaxUs;			//Grösste Laufzeit in us
+	unsigned int Overrun;		//Anzahl Läufe über dem Budget
+	unsigned int Missed;		//Anzahl verpasster Perioden (Start mehr als eine Periode zu spät)
+} SchedState_t;
+
+//Globale Variablen und Funktionen der Module, beschrieben bei ihrer Definition
+//Die Headerdatei wird nach avr/pgmspace.h und zkslibadc.h eingebunden (Typen der ADC-Library)
+
+//control.c: Motoren, PWM, Rampe, Drehzahlregelung, Fehlerabschaltung und Strombegrenzung
+//Die ISRs der PWM (main.c) greifen direkt auf Motor, SysTick und die Zustände der Messungen zu
+extern Motor_t Motor[MotorCount];
+extern volatile unsigned char mode;
+extern volatile unsigned char stopped;
+extern adc_Snapshot_t AdcSnapshot;
+extern unsigned int VccMilliVolt;
+extern adc_mVScale_t MeasureScale;
+extern volatile unsigned int SysTick;
+extern unsigned char PwmTickCnt;
+extern unsigned char PwmTicksPerMs;
+extern unsigned int PwmPeriodUs;
+extern unsigned int PwmCompare;
+extern unsigned char RampProfile;
+extern unsigned long DriveSum[3];
+extern unsigned int SpeedSettleMs;
+extern long SpeedErrSum;
+#if SpeedSource==SpeedSrcBemf
+extern volatile unsigned char BemfState;
+extern unsigned char BemfCnt;
+extern unsigned char BemfChannel;
+#endif
+#ifdef TACHO
+extern volatile unsigned int TachOvf;
+extern volatile unsigned long TachLastEdge;
+extern volatile unsigned long TachSum;
+extern volatile unsigned char TachCnt;
+extern unsigned char TachRun;
+extern unsigned long TachPeriod[1<<TachAvgBits];
+extern unsigned char TachIdx;
+#endif
+extern volatile unsigned char CurLimCut;
+extern volatile unsigned char CurLimOn;
+extern volatile unsigned char CurLimStart;
+extern volatile unsigned int CurLimCount;
+extern volatile unsigned char PwmCom;
+extern volatile unsigned int FaultLatency;
+#ifdef PWMHARDWARE
+extern const unsigned int PwmFreqTable[] PROGMEM;
+#endif
+
+void CCW_CW();
+void Auto_Man();
+#ifdef PWMHARDWARE
+unsigned char SetPwmFrequency(unsigned int Hz);
+void ApplyDirection();
+void timer1_init();
+#else
+void SetDriveMode(Motor_t * M, unsigned char Drive);
+void DriveMeasure();
+#endif
+#ifdef TACHO
+void TachInit();
+unsigned long TachGetRpmQ4(unsigned long * EdgeTime);
+#endif
+void RampResetAll();
+void RampUpdateAll();
+#ifdef MOTOR2
+void MotorFollow();
+unsigned char MotorCommand(unsigned char Cmd);
+#endif
+#ifdef MOTORFAULT
+void FaultInit();
+void FaultHandle();
+#endif
+#ifdef CURRENTLIMIT
+void CurLimInit();
+unsigned int CurLimGetCount();
+#endif
+void MeasureScaleUpdate();
+void timer0_init();
+#ifdef MOTOR2
+void timer2_init();
+#endif
+
+//uartcmd.c: Befehle über UART, Sendepuffer der Antworten, ADC-Aufzeichnung und Kalibrierung
+unsigned char TxEmpty();
+void TxByte(unsigned char Data);
+void TxUint(unsigned long Value, unsigned char N);
+void TxCrLf();
+void TxPump();
+void CaptureStart();
+void CaptureDump();
+void CaptureTrigger();
+void CalStep();
+void UartCommand();
+
+//sched.c: Scheduler und Schleifenrate
+extern unsigned char SchedReportPos;
+extern unsigned long LoopCount;
+extern unsigned long LoopRateLast;
+unsigned char SchedInit(const SchedTask_t * Table, unsigned char Count);
+unsigned char SchedRun();
+void SchedReport();
+void LoopMeasure();
 
-void CCW_CW(){
-	switch(PIND & (CCW | CW)){
-		case CW:
-			direction = DirForward;
-			LED_Green_Off;
-			LED_Red_On;
+//Ein-Phase eines Motors: Eingänge der Brücke nach der Richtung an der Brücke setzen (aus der PWM-ISR)
+//Beide Pins werden mit einem Zugriff geschrieben, bei DriveCoast danach Enable wieder ein
+static inline void MotorOn(Motor_t * M){
+	unsigned char State;
+	switch(M->OutDirection){
+		case DirForward:
+			State=M->PinForward;
 			break;
-		case CCW:
-			direction = DirReverse;
-			LED_Green_On;
-			LED_Red_Off;
+		case DirReverse:
+			State=(M->Drive==DriveAntiphase)?M->PinForward:M->PinReverse;
 			break;
 		default:
-			direction = DirBrake;
-			LED_Red_Off;
-			LED_Green_Off;
+			State=M->PinForward|M->PinReverse;
 			break;
 	}
+	*M->Port=(*M->Port&~(M->PinForward|M->PinReverse))|State;
+	if(M->Drive==DriveCoast) *M->EnPort|=M->PinEnable;
 }
 
-void Auto_Man(){
-	switch(PIND & (MAN | AUTO)){
-		case MAN:
-			mode=ModeMan;
-			break;
-		case AUTO:
-			mode=ModeAuto;
-			break;
-		default:
-			mode=ModeStop;
-			break;
+//Aus-Phase eines Motors nach der Betriebsart (aus der PWM-ISR)
+//Nach einer Fehlerabschaltung wird in jeder Betriebsart gebremst, statt Freilauf bzw. Gegenrichtung
+static inline void MotorOff(Motor_t * M){
+#ifdef MOTORFAULT
+	if(MotorFault){
+		MotorBrake(M);
+		return;
 	}
+#endif
+	if(M->OutDirection!=DirBrake){
+		if(M->Drive==DriveCoast){
+			*M->EnPort&=~M->PinEnable;
+			return;
+		}
+		if(M->Drive==DriveAntiphase){
+			*M->Port=(*M->Port&~(M->PinForward|M->PinReverse))|M->PinReverse;
+			return;
+		}
+	}
+	MotorBrake(M);
 }
 
-void timer0_init() {
-	// Set timer0 to normal mode
-	TCCR0A &= ~((1<<WGM01) | (1<<WGM00));
-	TCCR0B &= ~(1<<WGM02);
-
-	// Enable compare match interrupt
-	TIMSK0 |= (1<<OCIE0A);
-	// Enable timer overflow interrupt
-	TIMSK0 |= (1<<TOIE0);
-
-	// Set the initial value for OCR0A (the compare match register)
-	OCR0A = 0x00;
-
-	// Set the prescaler to 64
-	TCCR0B |= (1<<CS01);
+//Aus-Phase von Motor 1 aus der Überlauf-ISR der Software-PWM
+//Mit CURRENTLIMIT wird die Gegenphase von DriveAntiphase wie eine Ein-Phase begrenzt (Austastzeit ab dem Überlauf)
+static inline void Motor1Off(){
+#ifdef CURRENTLIMIT
+	if((Motor[0].Drive==DriveAntiphase)&&(Motor[0].OutDirection!=DirBrake)){
+		if(CurLimOver){		//Strom noch über der Grenze: Gegenphase auslassen
+			MotorBrake(&Motor[0]);
+			CurLimCount++;
+			return;
+		}
+		CurLimStart=TCNT0;
+		CurLimOn=1;
+	}
+#endif
+	MotorOff(&Motor[0]);
+}
 
-	// Enable global interrupts
-	sei();
+#ifdef CURRENTLIMIT
+//Laufende Phase von Motor 1 wegen Überstrom beenden, bis zur nächsten Flanke der PWM
+//Bei DriveAntiphase treibt auch die Aus-Phase die Brücke, dort wird gebremst
+static inline void CurLimOff(){
+	if(Motor[0].Drive==DriveAntiphase) MotorBrake(&Motor[0]);
+	else MotorOff(&Motor[0]);
 }
+#endif
 #endif /* DEFINES_H_ */
\ No newline at end of file
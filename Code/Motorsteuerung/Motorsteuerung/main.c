@@ -9,89 +9,353 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <stdlib.h>
+#include <avr/pgmspace.h>
 #include "zkslibadc.h"
-#include "defines.h"		//Eigene Headerdatei einbinden
 #include "zkslibuart.h"
+#include "defines.h"		//Eigene Headerdatei einbinden
 
+#ifndef PWMHARDWARE
 // Compare match ISR
-ISR(TIMER0_COMPA_vect) {
-	switch (direction) {		//Motorpin nach vorgegebener Richtung togglen
-		case DirForward:
-			Forward;
-			break;
-		case DirReverse:
-			Reverse;
-			break;
-		case DirBrake:
-			Brake;
-			break;
-		default:
-			Brake;
-			break;
+ISR(TIMER0_COMPB_vect) {
+#ifdef MOTORFAULT
+	if (MotorFault) {	//Nach einer Fehlerabschaltung nicht mehr einschalten, auch nach einer Aus-Phase im Freilauf bremsen
+		MotorBrake(&Motor[0]);
+		return;
+	}
+#endif
+#ifdef CURRENTLIMIT
+	if (CurLimOver) {	//Strom noch ber der Grenze, ohne neue Flanke kme keine Komparator-ISR: Ein-Phase auslassen
+		CurLimOff();	//Vor Enable: nach einer Aus-Phase im Freilauf zeigen die Eingnge noch die Ein-Phase
+		CurLimCount++;
+		return;
 	}
+	CurLimStart = TCNT0;	//Beginn der Austastzeit
+#endif
+#if SpeedSource==SpeedSrcBemf
+	Enable;		//Ende des Freilaufs einer Messperiode, die Eingnge zeigen noch den letzten Zustand
+#endif
+	MotorOn(&Motor[0]);		//Motorpin nach der Richtung der Rampe togglen
+#ifdef CURRENTLIMIT
+	CurLimOn = (Motor[0].OutDirection != DirBrake);	//Strombegrenzung bis zum berlauf wirksam
+#endif
 }
 
 // Timer overflow ISR
 ISR(TIMER0_OVF_vect) {
-	Brake;
+#ifdef CURRENTLIMIT
+	CurLimOn = 0;		//Ende der Ein-Phase, bei DriveAntiphase begrenzt Motor1Off die Gegenphase
+#endif
+#if SpeedSource==SpeedSrcBemf
+	if (BemfState == BemfArmed) {	//Messperiode: Freilauf statt Bremsen, Compare A wandelt die Gegen-EMK
+		if ((Motor[0].OutDirection == DirBrake)	//Inzwischen Stillstand oder Umkehr: bremsen statt Freilauf
+#ifdef MOTORFAULT
+			|| MotorFault						//Nach einer Fehlerabschaltung kein Freilauf
+#endif
+			) MotorBrake(&Motor[0]);
+		else MOTOR_PORT &= ~MOTOR_Enable;
+		DutyCycle = Motor[0].Duty8;		//Ab der nchsten Periode wieder die normalen Werte
+		SamplePoint = SampleMid(Motor[0].Duty8);
+		BemfState = BemfIdle;
+	} else {
+		Motor1Off();
+		//Gebremst wird nie gemessen, der Motor bleibt im Stillstand und bei der Umkehr kurzgeschlossen
+		if ((Motor[0].OutDirection != DirBrake) && (--BemfCnt == 0)) {	//Werte fr die nchste Periode als Messperiode puffern
+			BemfCnt = BemfPeriods;
+			DutyCycle = (Motor[0].Duty8 < BemfOnMin) ? BemfOnMin : Motor[0].Duty8;
+			SamplePoint = BemfSampleCnt;
+			TIFR0 = (1<<OCF0A);		//Flag der Vorperiode lschen, sonst kme die Compare A ISR sofort
+			TIMSK0 |= (1<<OCIE0A);
+			BemfState = BemfArmed;
+		}
+	}
+#else
+	Motor1Off();
+#endif
+	if (++PwmTickCnt >= PwmTicksPerMs) {	//SysTick fr die Rampe
+		PwmTickCnt = 0;
+		SysTick++;
+	}
+}
+
+#if SpeedSource==SpeedSrcBemf
+// Compare A ISR: nur in der Periode vor einer Messung freigegeben, ihre Scan-Wandlung luft gerade
+// Die eingeschobene Wandlung erfolgt dadurch genau beim nchsten Trigger (Compare A der Messperiode)
+ISR(TIMER0_COMPA_vect) {
+	TIMSK0 &= ~(1<<OCIE0A);
+	BemfChannel = (BemfChannel == MeasureChannel1) ? MeasureChannel2 : MeasureChannel1;
+	adc_Inject_Int(BemfChannel, ADC_VREF_VCC);
+}
+#endif
+
+#ifdef MOTOR2
+// Motor 2: Compare B von Timer2 schaltet die Ein-Phase, der berlauf die Aus-Phase nach der Betriebsart
+ISR(TIMER2_COMPB_vect) {
+#ifdef MOTORFAULT
+	if (MotorFault) {
+		MotorBrake(&Motor[1]);
+		return;
+	}
+#endif
+	MotorOn(&Motor[1]);
+}
+
+ISR(TIMER2_OVF_vect) {
+	MotorOff(&Motor[1]);
+}
+#endif
+#else
+// Timer1 overflow ISR (BOTTOM): nur SysTick fr die Rampe, die Ausgnge schaltet die Hardware
+ISR(TIMER1_OVF_vect) {
+	if (++PwmTickCnt >= PwmTicksPerMs) {
+		PwmTickCnt = 0;
+		SysTick++;
+	}
+}
+#endif
+
+#ifdef TACHO
+// Input Capture ISR: Periode seit der letzten Flanke in das Fenster der Mittelung eintragen
+// Feste Laufzeit ohne Division, die Drehzahl wird erst beim Auslesen berechnet
+ISR(TIMER1_CAPT_vect) {
+	unsigned int Low = ICR1;
+	unsigned int High = TachOvf;
+	unsigned long Edge;
+	unsigned long Period;
+	if ((TIFR1 & (1<<TOV1)) && (Low < 0x8000)) High++;	//berlauf vor der Flanke, seine ISR ist noch nicht gelaufen
+	Edge = ((unsigned long)High << 16) | Low;
+	Period = Edge - TachLastEdge;
+	TachLastEdge = Edge;
+	if (!TachRun || (Period > TachTimeout)) {		//Erste Flanke nach Start oder Stillstand: Fenster neu beginnen
+		TachRun = 1;
+		TachSum = 0;
+		TachCnt = 0;
+		TachIdx = 0;
+		return;
+	}
+	if (TachCnt < (1<<TachAvgBits)) TachCnt++;
+	else TachSum -= TachPeriod[TachIdx];
+	TachPeriod[TachIdx] = Period;
+	TachSum += Period;
+	TachIdx = (TachIdx + 1) & ((1<<TachAvgBits) - 1);
+}
+
+// Timer1 overflow ISR: obere 16 Bit der Zeitstempel
+ISR(TIMER1_OVF_vect) {
+	TachOvf++;
+}
+#endif
+
+#ifdef CURRENTLIMIT
+#ifdef PWMHARDWARE
+// Komparator ISR: Strombegrenzung, die Ein-Phase liegt um BOTTOM (TCNT1 unter dem Compare-Wert)
+// Die Compare-Ausgnge werden getrennt (Brake) und erst bei TOP, in der Mitte der Aus-Phase, wieder verbunden
+ISR(ANA_COMP_vect) {
+	if (CurLimCut || (TCNT1 >= PwmCompare)) return;
+	Brake;
+	CurLimCut = 1;
+	CurLimCount++;
+	TIFR1 = (1<<ICF1);
+	TIMSK1 |= (1<<ICIE1);
+}
+
+// TOP von Timer1 (ICF1, da ICR1 das TOP ist): nach einer gekrzten Periode wieder einschalten
+// Liegt der Strom noch ber der Grenze, kme keine neue Flanke: getrennt bleiben und beim nchsten TOP prfen
+ISR(TIMER1_CAPT_vect) {
+	if (CurLimOver) {
+		CurLimCount++;
+		return;
+	}
+	TIMSK1 &= ~(1<<ICIE1);
+	PwmOut(PwmCom);
+	CurLimCut = 0;
+}
+#else
+// Komparator ISR: Strombegrenzung, nur in einer treibenden Phase wirksam (CurLimOn): Ein-Phase, bei
+// DriveAntiphase auch die Gegenphase. Eine Flanke in der Austastzeit (Einschaltspitze) wird ohne Warten
+// ignoriert. Bleibt der Strom danach ber der Grenze, lsst die nchste Flanke der PWM ihre Phase aus
+ISR(ANA_COMP_vect) {
+	if (!CurLimOn || ((unsigned char)(TCNT0 - CurLimStart) < CurLimBlank) || !CurLimOver) return;
+	CurLimOff();	//Rest der Phase wie die Aus-Phase der Betriebsart, bei DriveAntiphase Brake
+	CurLimOn = 0;
+	CurLimCount++;
+}
+#endif
+#endif
+
+#ifdef MOTORFAULT
+// Komparator ISR: Fehlerabschaltung
+// Zuerst bremsen, dann das Flag setzen und die Zeit seit der Flanke (Input Capture) messen
+// Ca. 30 Takte von der Flanke bis Brake, solange keine andere ISR luft
+ISR(ANA_COMP_vect) {
+	Brake;
+	Enable;		//In der Aus-Phase von DriveCoast ist Enable aus, erst damit bremst die Brcke
+#ifdef MOTOR2
+	MotorBrake(&Motor[1]);
+#endif
+	GPIOR0|=(1<<FaultBit);
+#if !defined(PWMHARDWARE)&&!defined(TACHO)
+	FaultLatency=TCNT1-ICR1;
+#endif
 }
+#endif
+
+// Scan-Tabelle fr den ADC, der Index entspricht der ScanId aus defines.h
+// Die Messkanle werden in jedem Durchlauf ohne Einschwing-Wandlung gemessen, auf 12 Bit
+// berabgetastet und mit einem EMA (k=2) geglttet. Die Potis ndern sich langsam, werden
+// seltener abgetastet und nur mit einem Median gegen Kratzen des Schleifers gefiltert
+const adc_ScanEntry_t ScanTable[] PROGMEM = {
+	{MeasureChannel1, ADC_VREF_VCC, 0, 1, MeasureOsrBits, ADC_FILT_EMA, 2},	//ScanId 0: Messkanal 1
+	{MeasureChannel2, ADC_VREF_VCC, 0, 1, MeasureOsrBits, ADC_FILT_EMA, 2},	//ScanId 1: Messkanal 2
+	{SwitchChannel, ADC_VREF_VCC, 1, 8, 0, ADC_FILT_MED3, 0},	//ScanId 2: Schwellwert-Poti, jeder 8. Durchlauf
+	{SpeedChannel, ADC_VREF_VCC, 1, 4, 0, ADC_FILT_MED3, 0},	//ScanId 3: Geschwindigkeits-Poti, jeder 4. Durchlauf
+	{ADC_CH_VBG, ADC_VREF_VCC, 2, 8, 0, ADC_FILT_EMA, 3}		//ScanId 4: Bandgap fr die Vcc-Messung, Einschwingzeit ca. 70us
+};
+
+// Callback der ADC-Library (Trigger-Ereignisse der Scan-Kanle)
+// Wird ber die Event-Queue aus dem Hauptprogramm aufgerufen (adc_ProcessEvents_Int), nicht aus der ISR
+void adc_AdcFunction(uint8_t ScanId, uint8_t EventId) {
+	// Trigger werden nicht verwendet, die Werte werden im Hauptprogramm ausgewertet
+}
+
+
+// Regelung, jeden SysTick: Messwerte holen, Rampen und Regler nachfhren
+void TaskControl(void) {
+	//printf("\f");
+	//printf("Channel 1: %u \nChannel 2: %u \nSchwellwert: %u\nSpeed: %u\n\n", MeasureChannel1Value, MeasureChannel2Value, Schwellwert, adc_Read_8(SpeedChannel));
+	adc_GetSnapshot_Int(&AdcSnapshot);	//Alle Messwerte aus dem selben Scan-Durchlauf holen
+	adc_ProcessEvents_Int();	//Trigger-Ereignisse der ADC-Kanle abarbeiten
+	SetSpeed;		//Sollwert der Geschwindigkeit setzen
+	VccMilliVolt=adc_Get_Vcc_mV_Int();	//Vcc nachfhren, rechnet nur nach einem neuen Bandgap-Wert
+	MeasureScaleUpdate();	//Umrechnung der Messkanle in mV an die Vcc anpassen
+	CalStep();			//Laufende Kalibrierung um einen Snapshot fortsetzen
+#ifndef PWMHARDWARE
+	DriveMeasure();		//Messwerte fr den Vergleich der Betriebsarten mitteln
+#endif
+#ifdef MOTOR2
+	MotorFollow();		//Motor 2 bernimmt Richtung und Sollwert, sofern er nicht eigenstndig fhrt
+#endif
+	RampUpdateAll();	//Duty Cycle und Richtung mit begrenzter Beschleunigung nachfhren
+#ifdef PWMHARDWARE
+	ApplyDirection();	//Richtung auf die Compare-Ausgnge von Timer1 bertragen
+#endif
+}
+
+// Eingaben, alle 10ms: Schalter, Automatik und Fehler, die Richtung bernimmt die Regelung
+void TaskInputs(void) {
+	unsigned int Differenz;	//Differenz der beiden Messkanle im Automatikmodus (12 Bit)
+	unsigned int SchwelleAktuell;	//Schwellwert aus dem selben Snapshot (12 Bit)
+	Auto_Man();			//Modus auswhlen
+#ifdef MOTORFAULT
+	FaultHandle();		//Nach einer Fehlerabschaltung gebremst bleiben (Modus ModeFault)
+#endif
+	if (mode==ModeMan)	//Falls im Manuellen Modus
+	{
+		//printf("Manual\n");
+		stopped=Go;		//Stopvariable zurcksetzen
+		CCW_CW();		//CCW(Reverse) oder CW(Forward) fahren
+	}
+	if (mode==ModeAuto)		//Falls im Automatikmodus
+	{
+		//printf("Automatik: ");
+		//printf("Schwellwert: %u\n", Schwellwert);
+		//printf("Kanal 2: %u\n\n", MeasureChannel2Value);
+		Differenz=abs((int)MeasureChannel2Value-(int)MeasureChannel1Value);	//Nur einmal berechnen, damit alle Vergleiche das selbe Messwertpaar nutzen
+		SchwelleAktuell=Schwellwert;
+		if ((Differenz<SchwelleAktuell)&&stopped==Go)//Schwellwert unterschritten --> CW (Forward) fahren
+		{
+			//printf("Forward\n");
+			Motor[0].Direction=DirForward;		//Vorwrts (CW) fahren
+			LED_Red_Off;	//Rote LED ausschalten
+			LED_Green_On;	//Grne LED einschalten
+		}
+		if ((Differenz>SchwelleAktuell)&&stopped==Go)//Schwellwert berschritten -->CCW (Reverse) fahren
+		{
+			//printf("Reverse\n");
+			Motor[0].Direction=DirReverse;		//Rckwrts (CCW) fahren
+			LED_Green_Off;	//Grne LED ausschalten
+			LED_Red_On;		//Rote LED einschalten
+		}
+		else if (MeasureMilliVolt(Differenz)<untererSchwellwert_mV)//Spannung unter Schwellwert(10V) gefallen --> Stoppen
+		{
+			//printf("Stopped\n");
+			stopped=Stop;	//Stopvariable setzen --> System steht
+			Motor[0].Direction=DirBrake;			//Motor bremsen
+			LED_Green_Off;	//Grne LED ausschalten
+			LED_Red_Off;	//Rote LED ausschalten
+		}
+		//_delay_ms(500);
+	}
+	CaptureTrigger();	//Scharfe Aufzeichnung bei Richtungswechsel einfrieren
+}
+
+// Telemetrie, alle 50ms: Befehle ber UART, die Antworten gehen in den Sendepuffer und werden in der Hauptschleife gesendet
+void TaskTelemetry(void) {
+	UartCommand();		//Befehle ber UART (Aufzeichnung, Kalibrierung)
+	SchedReport();		//Statistik der Aufgaben, eine Zeile pro Aufruf
+}
+
+// Schleifenrate, jede Sekunde: Messfenster fr den Befehl 'l' abschliessen
+void TaskLoop(void) {
+	LoopMeasure();
+}
+
+// Aufgaben des Schedulers nach Prioritt, Periode in SysTick (1.024ms bei der Software-PWM), Budget in us
+const SchedTask_t SchedTasks[] PROGMEM = {
+	{TaskControl, 1, 250},		//Regelung mit ca. 1kHz
+	{TaskInputs, 10, 250},		//Eingaben mit ca. 100Hz
+	{TaskTelemetry, 50, 1000},	//Telemetrie mit ca. 20Hz, schreibt hchstens eine Zeile in den Sendepuffer
+	{TaskLoop, LoopWindowMs, 250}	//Schleifenrate mit ca. 1Hz
+};
 
 
 int main(void)
 {
-	DDRB = MOTOR_Enable | MOTOR_Forward | MOTOR_Reverse;	//Datenrichtungsregister fr MotorEnable, MotorForward und MotorReverse aus Ausgang setzen
+	MOTOR_DDR = MOTOR_Enable | MOTOR_Bridge;	//Datenrichtungsregister fr MotorEnable, MotorForward und MotorReverse aus Ausgang setzen
 	DDRD = LED_Green | LED_Red;		//Datenrichtungsregister fr LED-Green und LED-Red aus Ausgang setzen
 	DDRD &= ~CCW & ~CW & ~MAN & ~AUTO;	//Datenrichtungsregister fr CCW, CW, MAN und AUTO auf Eingang setzen
 	PORTD |= CCW | CW | MAN | AUTO;	//Pullup fr CCW, CW, MAN und AUTO aktivieren
 	Enable;			//Motortreiber enablen
+#ifdef MOTOR2
+	MOTOR2_DDR |= MOTOR2_Bridge;	//Brcke von Motor 2, Enable an einem anderen Port
+	MOTOR2_EN_DDR |= MOTOR2_Enable;
+	Enable2;
+#endif
+#ifdef TACHO
+	TachInit();		//Drehzahlgeber an ICP1, Timer1 als Zeitbasis (vor sei, schreibt PORTB)
+#endif
+#ifdef PWMHARDWARE
+	timer1_init();	//Hardware-PWM auf Timer1, 16 Bit Phase and Frequency Correct
+#else
 	timer0_init();	//Timer0 initialisieren
-	adc_Init(ADC_VREF_VCC);
-	DutyCycle=255;	//Duty Cycle auf Stillstand (0%) setzen
-	//uart_Init(UART_BAUDRATE_9600, UART_CONFIG_8N1);
+#ifdef MOTOR2
+	timer2_init();	//Timer2 fr Motor 2, synchron zu Timer0
+#endif
+#endif
+#ifdef MOTORFAULT
+	FaultInit();	//Fehlerabschaltung ber den Komparator
+#endif
+#ifdef CURRENTLIMIT
+	CurLimInit();	//Strombegrenzung pro PWM-Periode ber den Komparator
+#endif
+	//ADC-Kanle gemss Scan-Tabelle im Hintergrund per Interrupt abtasten
+	//Eine Wandlung pro PWM-Periode, gestartet durch Timer0 Compare A in der Mitte der Ein-Phase
+#ifdef PWMHARDWARE
+	adc_SetTrigger_Int(ADC_TRIG_T1_OVF);	//Wandlung bei BOTTOM von Timer1 = Mitte der Ein-Phase
+#else
+	adc_SetTrigger_Int(ADC_TRIG_T0_COMPA);
+#endif
+	adc_Init_Scan_Int(ScanTable, sizeof(ScanTable)/sizeof(ScanTable[0]), ADC_CLKDIV_64);	//ADC-Takt 250kHz, ca. 52us pro Wandlung (PWM-Periode 128us)
+	RampResetAll();		//Duty Cycle aller Motoren auf Stillstand (0%) setzen und bremsen
+	uart_Init(UART_BAUDRATE_57600, UART_CONFIG_8N1);	//Ausgabe der ADC-Aufzeichnung
+	CaptureStart();		//Messkanle laufend aufzeichnen, ausgelst und gesendet wird erst nach Befehl 'a' oder 't'
 	//printf("Start\n");
 	/* Replace with your application code */
+	SchedInit(SchedTasks, sizeof(SchedTasks)/sizeof(SchedTasks[0]));	//Feste Perioden ab jetzt
 	while (1)
 	{
-		//printf("\f");
-		//printf("Channel 1: %u \nChannel 2: %u \nSchwellwert: %u\nSpeed: %u\n\n", MeasureChannel1Value, MeasureChannel2Value, Schwellwert, adc_Read_8(SpeedChannel));
-		SetSpeed;		//Geschwindigkeit setzen
-		Auto_Man();			//Modus auswhlen
-		if (mode==ModeMan)	//Falls im Manuellen Modus
-		{
-			//printf("Manual\n");
-			stopped=Go;		//Stopvariable zurcksetzen
-			CCW_CW();		//CCW(Reverse) oder CW(Forward) fahren
-		}
-		if (mode==ModeAuto)		//Falls im Automatikmodus
-		{
-			//printf("Automatik: ");
-			//printf("Schwellwert: %u\n", Schwellwert);
-			//printf("Kanal 2: %u\n\n", MeasureChannel2Value);
-			if (((abs(MeasureChannel2Value-MeasureChannel1Value))<Schwellwert)&&stopped==Go)//Schwellwert unterschritten --> CW (Forward) fahren
-			{
-				//printf("Forward\n");
-				direction=DirForward;		//Vorwrts (CW) fahren
-				LED_Red_Off;	//Rote LED ausschalten
-				LED_Green_On;	//Grne LED einschalten
-			}
-			if (((abs(MeasureChannel2Value-MeasureChannel1Value))>Schwellwert)&&stopped==Go)//Schwellwert berschritten -->CCW (Reverse) fahren
-			{
-				//printf("Reverse\n");
-				direction=DirReverse;		//Rckwrts (CCW) fahren
-				LED_Green_Off;	//Grne LED ausschalten
-				LED_Red_On;		//Rote LED einschalten
-			}
-			else if ((abs(MeasureChannel2Value-MeasureChannel1Value))<untererSchwellwert)//Spannung unter Schwellwert(10V) gefallen --> Stoppen
-			{
-				//printf("Stopped\n");
-				stopped=Stop;	//Stopvariable setzen --> System steht
-				direction=DirBrake;			//Motor bremsen
-				LED_Green_Off;	//Grne LED ausschalten
-				LED_Red_Off;	//Rote LED ausschalten
-			}
-			//_delay_ms(500);
-		}
-		
+		SchedRun();			//Fllige Aufgabe mit der hchsten Prioritt ausfhren
+		TxPump();			//Antworten byteweise senden, ohne zu warten
+		CaptureDump();		//Im Leerlauf: eingefrorene, scharf geschaltete Aufzeichnung byteweise senden
+		LoopCount++;		//Durchlufe fr die Messung der Schleifenrate (Befehl 'l')
 	}
 }
-
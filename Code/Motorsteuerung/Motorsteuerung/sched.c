@@ -0,0 +1,146 @@
+/*
+ * sched.c
+ *
+ * Created: 17/10/2026
+ * Kooperativer Scheduler mit festen Perioden und Messung der Schleifenrate
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "zkslibadc.h"
+#include "defines.h"
+
+const SchedTask_t * SchedTable;		//Aufgaben, nach Prioritt geordnet
+unsigned char SchedCount = 0;
+SchedState_t SchedState[SchedTaskMax];
+unsigned char SchedReportPos = 0;	//Nchste Zeile der Statistik + 1, 0: keine Ausgabe
+unsigned long LoopCount = 0;		//Durchlufe der Hauptschleife im laufenden Messfenster
+unsigned int LoopTick = 0;			//SysTick beim Start des Messfensters
+unsigned long LoopRateLast = 0;		//Durchlufe pro Sekunde im letzten Messfenster (LoopCmdRate)
+
+//Zeitstempel in us fr die Laufzeitmessung, luft nach ca. 65ms ber (Differenzen bleiben gltig)
+//Ein berlauf, dessen ISR noch nicht gelaufen ist, wird am gesetzten TOV erkannt
+unsigned int SchedNowUs(){
+	unsigned int Periods;
+	unsigned char Sreg;
+#ifdef PWMHARDWARE
+	Sreg=SREG;
+	cli();
+	Periods=SysTick*PwmTicksPerMs+PwmTickCnt;
+	if(TIFR1&(1<<TOV1)) Periods++;
+	SREG=Sreg;
+	return Periods*PwmPeriodUs;
+#else
+	unsigned char Cnt;
+	Sreg=SREG;
+	cli();
+	Cnt=TCNT0;
+	Periods=SysTick*PwmTicksPerMs+PwmTickCnt;
+	if((TIFR0&(1<<TOV0))&&(Cnt<128)) Periods++;
+	SREG=Sreg;
+	return (Periods<<7)+(Cnt>>1);	//128us pro Periode, Timer0 mit 2MHz
+#endif
+}
+
+//Aktueller SysTick
+unsigned int SchedTick(){
+	unsigned int Now;
+	unsigned char Sreg;
+	Sreg=SREG;
+	cli();
+	Now=SysTick;
+	SREG=Sreg;
+	return Now;
+}
+
+//Aufgaben bernehmen, alle starten beim nchsten Aufruf von SchedRun
+unsigned char SchedInit(const SchedTask_t * Table, unsigned char Count){
+	unsigned char i;
+	unsigned int Now;
+	if(Count>SchedTaskMax) return 0;
+	SchedTable=Table;
+	SchedCount=Count;
+	Now=SchedTick();
+	for(i=0;i<Count;i++){
+		SchedState[i].Next=Now;
+		SchedState[i].LastUs=0;
+		SchedState[i].MaxUs=0;
+		SchedState[i].Overrun=0;
+		SchedState[i].Missed=0;
+	}
+	return 1;
+}
+
+//Die fllige Aufgabe mit der hchsten Prioritt ausfhren, 0 wenn keine fllig war
+//Die nchste Startzeit wird um die Periode weitergezhlt, damit sich die Abstnde nicht verschieben
+//Nach einer verpassten Periode wird ab jetzt neu gezhlt, statt die Lufe nachzuholen
+unsigned char SchedRun(){
+	unsigned char i;
+	unsigned int Now;
+	unsigned int Period;
+	unsigned int Start;
+	unsigned int Time;
+	SchedState_t * S;
+	Now=SchedTick();
+	for(i=0;i<SchedCount;i++){
+		S=&SchedState[i];
+		if((int)(Now-S->Next)<0) continue;
+		Period=pgm_read_word(&SchedTable[i].PeriodMs);
+		if(Now-S->Next>=Period){
+			S->Missed++;
+			S->Next=Now;
+		}
+		S->Next+=Period;
+		Start=SchedNowUs();
+		((void (*)(void))pgm_read_ptr(&SchedTable[i].Func))();
+		Time=SchedNowUs()-Start;
+		S->LastUs=Time;
+		if(Time>S->MaxUs) S->MaxUs=Time;
+		if(Time>pgm_read_word(&SchedTable[i].BudgetUs)) S->Overrun++;
+		return 1;
+	}
+	return 0;
+}
+
+//Statistik der Aufgaben ausgeben und zurcksetzen, eine Zeile pro Aufruf aus TaskTelemetry
+//Die nchste Zeile wird erst geschrieben, wenn die vorherige gesendet ist (SchedReportPos)
+void SchedReport(){
+	unsigned char i;
+	SchedState_t * S;
+	if((SchedReportPos==0)||!TxEmpty()) return;
+	i=SchedReportPos-1;
+	S=&SchedState[i];
+	TxByte('0'+i);	//Index der Aufgabe, einstellig (SchedTaskMax)
+	TxByte(' ');
+	TxUint(pgm_read_word(&SchedTable[i].PeriodMs), 4);
+	TxByte(' ');
+	TxUint(pgm_read_word(&SchedTable[i].BudgetUs), 5);
+	TxByte(' ');
+	TxUint(S->LastUs, 5);
+	TxByte(' ');
+	TxUint(S->MaxUs, 5);
+	TxByte(' ');
+	TxUint(S->Overrun, 5);
+	TxByte(' ');
+	TxUint(S->Missed, 5);
+	TxCrLf();
+	S->MaxUs=0;
+	S->Overrun=0;
+	S->Missed=0;
+	SchedReportPos++;
+	if(SchedReportPos>SchedCount) SchedReportPos=0;
+}
+
+//Messfenster der Schleifenrate abschliessen und neu zhlen, aufgerufen von TaskLoop alle LoopWindowMs
+//Das Fenster ist nur bei einer verspteten Aufgabe lnger als 1s, LoopCount*1000 bleibt damit in 32 Bit
+void LoopMeasure(){
+	unsigned int Now;
+	unsigned int Ms;
+	Now=SchedTick();
+	Ms=Now-LoopTick;
+	if(Ms==0) return;
+	LoopRateLast=LoopCount*1000/Ms;
+	LoopCount=0;
+	LoopTick=Now;
+}
@@ -0,0 +1,405 @@
+/*
+ * uartcmd.c
+ *
+ * Created: 17/10/2026
+ * Befehle ber UART, Sendepuffer der Antworten, ADC-Aufzeichnung und Kalibrierung der Messkanle
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "zkslibadc.h"
+#include "zkslibuart.h"
+#include "defines.h"
+
+unsigned char TxBuf[TxBufLen];	//Sendepuffer der Antworten, wird im Leerlauf ber UART geleert (TxPump)
+unsigned char TxHead = 0;		//Schreibindex
+unsigned char TxTail = 0;		//Leseindex
+unsigned char LastDirection = 0;	//Richtung beim letzten Durchlauf, ein Wechsel lst die scharfe Aufzeichnung aus
+unsigned char CaptArmed = 0;	//1: Aufzeichnung per Befehl scharf geschaltet, nur dann wird ausgelst und ausgegeben
+unsigned int CaptSendPos = 0;	//Position in der Ausgabe der Aufzeichnung in Byte
+unsigned char CaptSendSum = 0;	//Prfsumme der Ausgabe
+unsigned char CalCmd = 0;		//Laufende Kalibrierung (CalCmdZero, CalCmdGain), 0: keine
+unsigned char CalCount = 0;		//Bisher summierte Snapshots
+unsigned int CalSeqNr = 0;		//Zuletzt summierter Snapshot
+unsigned long CalSum[2];		//Summen der beiden Messkanle
+adc_Calib_t CalOld[2];			//Kalibrierung vor der Messung, wird bei Abbruch oder Fehler wiederhergestellt
+volatile unsigned int MvBenchSink;	//Ergebnis der gemessenen Umrechnung, damit sie nicht wegoptimiert wird
+
+//Sendepuffer leer, alle Antworten sind an UART bergeben
+unsigned char TxEmpty(){
+	return TxHead==TxTail;
+}
+
+//Keine Antwort mehr ausstehend: Sendepuffer leer, Statistik ausgegeben und keine Kalibrierung aktiv
+unsigned char TxIdle(){
+	return TxEmpty()&&(SchedReportPos==0)&&(CalCmd==0);
+}
+
+//Ein Byte in den Sendepuffer schreiben, bei vollem Puffer geht es verloren
+//UartCommand fhrt einen Befehl erst bei leerem Puffer aus, eine Antwort passt also immer ganz hinein
+void TxByte(unsigned char Data){
+	unsigned char Next;
+	Next=(TxHead+1)&(TxBufLen-1);
+	if(Next==TxTail) return;
+	TxBuf[TxHead]=Data;
+	TxHead=Next;
+}
+
+//Zahl mit N Stellen (1..10) und fhrenden Nullen in den Sendepuffer, anders als uart_UintToUart auch fr N=1
+//Werte bis 16 Bit werden direkt mit 16-Bit-Divisionen gewandelt, uart_Uint2Txt rechnet immer
+//10 Stellen mit 32 Bit (ca. 375us pro Zahl)
+void TxUint(unsigned long Value, unsigned char N){
+	char Text[10];
+	unsigned char i;
+	unsigned int Value16;
+	if(N>10) N=10;
+	if(Value<=0xffff){
+		Value16=Value;
+		for(i=N;i>0;i--){
+			Text[i-1]='0'+Value16%10;
+			Value16/=10;
+		}
+	}
+	else N=uart_Uint2Txt(Value, Text, N);
+	for(i=0;i<N;i++) TxByte(Text[i]);
+}
+
+//Zahl mit Vorzeichen und N Stellen inklusive Vorzeichen, wie uart_IntToUart
+void TxInt(long Value, unsigned char N){
+	if(Value<0){
+		TxByte('-');
+		Value=-Value;
+	}
+	else TxByte('+');
+	TxUint(Value, N-1);
+}
+
+void TxCrLf(){
+	TxByte(UART_CR);
+	TxByte(UART_LF);
+}
+
+//Sendepuffer leeren, ohne zu warten: ein Byte, sobald das Datenregister frei ist (UDRE)
+//Wird aus der Hauptschleife aufgerufen, bei 57600 Baud braucht ein Byte ca. 174us
+void TxPump(){
+	if(TxEmpty()||!uart_TxReady()) return;
+	uart_SendByte(TxBuf[TxTail], UART_NO);
+	TxTail=(TxTail+1)&(TxBufLen-1);
+}
+
+//Aufzeichnung der beiden Messkanle starten (Roh-Werte, 10 Bit)
+void CaptureStart(){
+	CaptSendPos=0;
+	adc_StartCapture_Int(MeasureScanId1, MeasureScanId2, CaptPreTrig, ADC_CAPT_NOEVT, CaptExclusive);
+}
+
+//Byte Pos der Ausgabe bestimmen
+//Format: CaptSync1, CaptSync2, Anzahl Werte, Anzahl Werte vor dem Trigger, Werte, Prfsumme
+//16-Bit Grssen werden Little Endian gesendet, Werte: Bit 15..12 ScanId, Bit 9..0 ADC-Wert
+//Die Prfsumme ist die 8-Bit Summe aller Bytes nach CaptSync2
+unsigned char CaptureByte(unsigned int Pos, unsigned int Len, unsigned int PreTrig){
+	unsigned int Value;
+	switch(Pos){
+		case 0:
+			return CaptSync1;
+		case 1:
+			return CaptSync2;
+		case 2:
+		case 3:
+			Value=Len;
+			break;
+		case 4:
+		case 5:
+			Value=PreTrig;
+			break;
+		default:
+			if(Pos>=CaptHeaderLen+2*Len) return CaptSendSum;
+			Value=adc_ReadCapture_Int((Pos-CaptHeaderLen)>>1);
+			break;
+	}
+	if(Pos&0x01) return (unsigned char)(Value>>8);
+	return (unsigned char)Value;
+}
+
+//Fertige Aufzeichnung ber UART ausgeben, ohne die Hauptschleife zu blockieren
+//Pro Aufruf wird hchstens ein Byte gesendet, sobald das Datenregister frei ist (UDRE)
+//Die Ausgabe beginnt erst, wenn alle Antworten gesendet sind, bis zum Ende werden keine Befehle
+//ausgefhrt (UartCommand), der Block wird also nicht durch Text unterbrochen
+//Ausgegeben wird nur eine per Befehl scharf geschaltete Aufzeichnung, ohne Befehl bleibt die Leitung stumm
+//Nach dem letzten Byte wird die nchste Aufzeichnung ungeschrft gestartet
+void CaptureDump(){
+	unsigned int Len;
+	uint16_t PreTrig;
+	unsigned char Data;
+	if(!CaptArmed||(adc_GetCaptureStatus_Int()!=ADC_CAPT_DONE)) return;
+	if(!TxIdle()||!uart_TxReady()) return;
+	Len=adc_GetCaptureLen_Int(&PreTrig);
+	if(CaptSendPos>CaptHeaderLen+2*Len){
+		CaptArmed=0;
+		CaptureStart();		//Letztes Byte ist gesendet
+		return;
+	}
+	Data=CaptureByte(CaptSendPos, Len, PreTrig);
+	if(CaptSendPos==2) CaptSendSum=0;
+	CaptSendSum+=Data;
+	uart_SendByte(Data, UART_NO);
+	CaptSendPos++;
+}
+
+//Aufzeichnung bei einem Richtungswechsel auslsen, wenn sie scharf geschaltet ist
+//Die Richtung wird immer nachgefhrt, der Startwert beim Einschalten lst daher nichts aus
+void CaptureTrigger(){
+	if(Motor[0].Direction!=LastDirection){
+		LastDirection=Motor[0].Direction;
+		if(CaptArmed) adc_TriggerCapture_Int();
+	}
+}
+
+//Nullpunkt eines Messkanals aus dem Mittelwert bernehmen, die Verstrkung bleibt zurckgesetzt
+unsigned char CalZero(unsigned char ScanId, unsigned int Ist){
+	adc_SetCalib_Int(ScanId, Ist, ADC_CALIB_GAIN_ONE);
+	return 1;
+}
+
+//Verstrkung eines Messkanals so bestimmen, dass CalRef_mV den Sollwert bei der gemessenen Vcc ergibt
+//Bei einem unplausiblen Ergebnis (Faktor ausserhalb 0.5..2) bleibt die alte Kalibrierung erhalten
+unsigned char CalGain(unsigned char ScanId, unsigned int Ist, adc_Calib_t * Old){
+	unsigned long Soll;
+	unsigned long Gain;
+	Soll=((unsigned long)CalRef_mV<<(10+MeasureOsrBits))/VccMilliVolt;
+	if(Ist!=0){
+		Gain=(Soll<<15)/Ist;
+		if((Gain>=ADC_CALIB_GAIN_ONE/2)&&(Gain<ADC_CALIB_GAIN_INVALID)){
+			adc_SetCalib_Int(ScanId, Old->Offset, (unsigned int)Gain);
+			return 1;
+		}
+	}
+	adc_SetCalib_Int(ScanId, Old->Offset, Old->Gain);
+	return 0;
+}
+
+//Kalibrierung der beiden Messkanle starten, gemessen wird ohne Kalibrierung (Nullpunkt) bzw. nur mit dem Nullpunkt (Verstrkung)
+//Die Mittelung luft in CalStep, pro SysTick ein Snapshot, damit TaskControl und TaskTelemetry ihr Budget einhalten
+void CalStart(unsigned char Cmd){
+	unsigned char i;
+	for(i=0;i<2;i++){
+		adc_GetCalib_Int(MeasureScanId1+i, &CalOld[i]);
+		adc_SetCalib_Int(MeasureScanId1+i, (Cmd==CalCmdZero) ? 0 : CalOld[i].Offset, ADC_CALIB_GAIN_ONE);
+		CalSum[i]=0;
+	}
+	CalCount=0;
+	CalSeqNr=AdcSnapshot.SeqNr;	//Erst ab dem nchsten Snapshot summieren
+	CalCmd=Cmd;
+}
+
+//Kalibrierung fortsetzen, wird aus TaskControl nach dem Holen des Snapshots aufgerufen
+//Verlsst die Bedienung den Modus Stop, wird abgebrochen und die alte Kalibrierung wiederhergestellt
+void CalStep(){
+	unsigned char i;
+	unsigned char Ok=1;
+	unsigned int Ist;
+	if(CalCmd==0) return;
+	if(mode!=ModeStop){
+		for(i=0;i<2;i++) adc_SetCalib_Int(MeasureScanId1+i, CalOld[i].Offset, CalOld[i].Gain);
+		CalCmd=0;
+		TxByte(CalError);
+		return;
+	}
+	if(AdcSnapshot.SeqNr==CalSeqNr) return;
+	CalSeqNr=AdcSnapshot.SeqNr;
+	for(i=0;i<2;i++) CalSum[i]+=AdcSnapshot.Value[MeasureScanId1+i];
+	if(++CalCount<CalSnapshots) return;
+	for(i=0;i<2;i++){
+		Ist=(unsigned int)(CalSum[i]/CalSnapshots);
+		if(CalCmd==CalCmdZero) Ok&=CalZero(MeasureScanId1+i, Ist);
+		else Ok&=CalGain(MeasureScanId1+i, Ist, &CalOld[i]);
+	}
+	TxByte(Ok ? CalCmd-'a'+'A' : CalError);
+	CalCmd=0;
+}
+
+#if !defined(PWMHARDWARE)&&!defined(TACHO)
+//Mittlere Laufzeit einer Umrechnung in mV in CPU-Takten, gemessen mit Timer1 ohne Prescaler (wie bei MOTORFAULT)
+//Scaled=0: Division (adc_Convert_mV_Int), 1: adc_Scale_mV, beide 10 Bit mit Teiler 100:10
+//Jede Umrechnung luft mit gesperrten Interrupts (hchstens ca. 50us), die Dauer des leeren Messrahmens wird abgezogen
+unsigned int MvBench(unsigned char Scaled){
+	adc_mVScale_t Scale;
+	unsigned long Sum=0;
+	unsigned int Start;
+	unsigned int Time;
+	unsigned int Empty;
+	unsigned int Value;
+	unsigned char Tccr;
+	unsigned char Sreg;
+	unsigned char i;
+	adc_Init_mV_Scale(&Scale, VccMilliVolt, 100, 10, 10);
+	Tccr=TCCR1B;
+	if(!(Tccr&((1<<CS12)|(1<<CS11)|(1<<CS10)))) TCCR1B=(1<<CS10);	//Timer1 steht (ohne MOTORFAULT), fr die Messung starten
+	Sreg=SREG;
+	cli();
+	Start=TCNT1;
+	MvBenchSink=Start;
+	Empty=TCNT1-Start;
+	SREG=Sreg;
+	for(i=0;i<MvBenchN;i++){
+		Value=(AdcSnapshot.Value[SpeedScanId]+i*67)&0x3ff;	//Verschiedene Werte, die Dauer der Division hngt vom Wert ab
+		cli();
+		Start=TCNT1;
+		if(Scaled) MvBenchSink=adc_Scale_mV(&Scale, Value);
+		else MvBenchSink=adc_Convert_mV_Int(Value, VccMilliVolt, 100, 10);
+		Time=TCNT1-Start;
+		SREG=Sreg;
+		Sum+=Time-Empty;
+	}
+	TCCR1B=Tccr;
+	return (unsigned int)(Sum/MvBenchN);
+}
+#endif
+
+//Befehle ber UART auswerten, die Antworten gehen in den Sendepuffer
+//Ein Befehl wird erst gelesen, wenn die vorherige Antwort gesendet ist und keine Aufzeichnung ausgegeben wird
+//Die Kalibrierung ist nur im Modus Stop mglich, der Motor wird dabei gebremst, die Antwort sendet CalStep
+void UartCommand(){
+	unsigned char Cmd;
+	unsigned char Ok=0;
+	unsigned char i;
+	if((CaptSendPos!=0)||!TxIdle()||!uart_NewData()) return;
+	Cmd=uart_GetData();
+	switch(Cmd){
+		case CaptCmdTrigger:
+			CaptArmed=1;
+			adc_TriggerCapture_Int();	//Die Ausgabe der Aufzeichnung ist die Antwort
+			return;
+		case CaptCmdArm:
+			CaptArmed=1;
+			Ok=1;
+			break;
+		case ProfileCmdNext:
+			RampProfile++;
+			if(RampProfile>=ProfileCount) RampProfile=ProfileLinear;
+			for(i=0;i<MotorCount;i++) Motor[i].ProfActive=0;	//Laufende bergnge mit dem neuen Verlauf neu starten
+			TxByte('P');
+			TxByte('0'+RampProfile);	//Einstellig
+			TxCrLf();
+			return;
+#ifndef PWMHARDWARE
+		case DriveCmdNext:
+			Cmd=Motor[0].Drive+1;
+			if(Cmd>=DriveCount) Cmd=DriveBrake;
+			for(i=0;i<MotorCount;i++) SetDriveMode(&Motor[i], Cmd);
+			TxByte('B');
+			TxByte('0'+Cmd);	//Einstellig
+			TxCrLf();
+			return;
+		case DriveCmdStat:
+			TxByte('0'+Motor[0].Drive);
+			for(i=0;i<3;i++){
+				TxByte(' ');
+				TxUint(DriveSum[i]>>DriveAvgBits, 5);	//Vcc und Messkanle in mV
+			}
+			TxByte(' ');
+			TxUint(Motor[0].DutyQ15, 5);
+			TxCrLf();
+			return;
+#endif
+		case SchedCmdReport:
+			SchedReportPos=1;	//Ausgabe Zeile fr Zeile in TaskTelemetry
+			return;
+		case LoopCmdRate:
+			TxUint(LoopRateLast, 7);
+			TxCrLf();
+			return;
+		case MotorCmdStatus:
+			for(i=0;i<MotorCount;i++){
+				TxByte('1'+i);		//Einstellige Werte direkt als Ziffer
+				TxByte(' ');
+				TxByte('0'+Motor[i].OutDirection);
+				TxByte(' ');
+				TxUint(Motor[i].DutyQ15, 5);
+				TxByte(' ');
+				TxUint(Motor[i].RampTargetQ15, 5);
+				TxByte(' ');
+				TxByte(Motor[i].Follow ? 'F' : 'E');
+				TxCrLf();
+			}
+			return;
+#ifdef MOTOR2
+		case MotorCmdForward:
+		case MotorCmdReverse:
+		case MotorCmdBrake:
+		case MotorCmdFaster:
+		case MotorCmdSlower:
+		case MotorCmdFollow:
+			Ok=MotorCommand(Cmd);
+			break;
+#endif
+#ifdef PWMHARDWARE
+		case PwmCmdFreq:
+		case PwmCmdFreq+1:
+		case PwmCmdFreq+2:
+		case PwmCmdFreq+3:
+		case PwmCmdFreq+4:
+			Ok=SetPwmFrequency(pgm_read_word(&PwmFreqTable[Cmd-PwmCmdFreq]));
+			break;
+#endif
+#if SpeedSource!=SpeedSrcNone
+		case SpeedCmdStatus:
+			TxUint(SpeedSettleMs, 5);
+			TxByte(' ');
+			TxInt(SpeedErrSum>>4, 6);
+			TxCrLf();
+			return;
+#endif
+#ifdef TACHO
+		case TachCmdRpm:
+			{
+				unsigned long Edge;
+				TxUint(TachGetRpmQ4(&Edge)>>4, 5);
+				TxByte(' ');
+				TxUint(Edge, 10);
+				TxCrLf();
+			}
+			return;
+#endif
+#ifdef CURRENTLIMIT
+		case CurLimCmdCount:
+			TxUint(CurLimGetCount(), 5);
+			TxCrLf();
+			return;
+#endif
+#if !defined(PWMHARDWARE)&&!defined(TACHO)
+		case MvCmdBench:
+			if(mode!=ModeStop) break;
+			TxUint(MvBench(0), 5);
+			TxByte(' ');
+			TxUint(MvBench(1), 5);
+			TxCrLf();
+			return;
+#endif
+#ifdef MOTORFAULT
+		case FaultCmdLatency:
+			TxUint(FaultLatency, 5);
+			TxCrLf();
+			return;
+#endif
+		case CalCmdZero:
+		case CalCmdGain:
+		case CalCmdSave:
+			if(mode!=ModeStop) break;
+			Motor[0].Direction=DirBrake;
+			RampResetAll();	//Sofort bremsen, die Rampe luft whrend der Messung nicht
+			if(Cmd!=CalCmdSave){
+				CalStart(Cmd);	//Mittelung ber die nchsten SysTicks in CalStep
+				return;
+			}
+			adc_SaveCalib_Int();
+			Ok=1;
+			break;
+		default:
+			return;
+	}
+	if(!Ok) Cmd=CalError;
+	else if((Cmd>='a')&&(Cmd<='z')) Cmd=Cmd-'a'+'A';
+	TxByte(Cmd);
+}
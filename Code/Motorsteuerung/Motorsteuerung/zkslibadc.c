@@ -6,6 +6,10 @@
 #include <util/delay.h>
 #include <stdint.h>
 #include "avr/interrupt.h"
+#include <avr/pgmspace.h>
+#ifdef ADCCALIB
+#include <avr/eeprom.h>
+#endif
 
 // Globale Variablen
 static uint8_t Adc_Status = ADC_STAT_CLOSED;
@@ -19,19 +23,104 @@ static uint16_t _Vcc_mV = ADC_VCC_NOM_MV;
 #define TRIG_STATUS_NEG 2
 #define TRIG_STATUS_INIT 3
 
-#define ADC_SCAN_CHANNELS 4
 
+// Standard Scan-Tabelle fr adc_Init_Int: Referenz und Kanal kommen aus adc_ConfigChannel_Int,
+// eine Einschwing-Wandlung pro Kanal, jeder Kanal in jedem Durchlauf, kein Oversampling, kein Filter
+static const adc_ScanEntry_t _loc_DefaultScanTable[ADC_SCAN_CHANNELS] PROGMEM = {[0 ... ADC_SCAN_CHANNELS-1]={0, ADC_VREF_VCC, 1, 1, 0, ADC_FILT_NONE, 0}};
 
 // Speicher fr die Interruptbasierte Abtastung
+static const adc_ScanEntry_t * _loc_ScanTable = _loc_DefaultScanTable;
+static volatile uint8_t _loc_ScanLen = ADC_SCAN_CHANNELS;
 static volatile uint16_t _loc_ScanData[ADC_SCAN_CHANNELS];
-static volatile uint16_t _loc_MuxData[ADC_SCAN_CHANNELS]={0b01000000, 0b01000001, 0b01000010, 0b01000011};
+static volatile uint8_t _loc_MuxData[ADC_SCAN_CHANNELS];
 static volatile uint16_t _loc_TrigData_Pos[ADC_SCAN_CHANNELS];
 static volatile uint16_t _loc_TrigData_Neg[ADC_SCAN_CHANNELS];	
 static volatile uint8_t _loc_HystData[ADC_SCAN_CHANNELS];	
-static volatile uint8_t _loc_TrigStatus[ADC_SCAN_CHANNELS]={TRIG_STATUS_INIT,TRIG_STATUS_INIT,TRIG_STATUS_INIT,TRIG_STATUS_INIT};
+static volatile uint8_t _loc_TrigStatus[ADC_SCAN_CHANNELS];
+static volatile uint8_t _loc_RateCnt[ADC_SCAN_CHANNELS];
+static volatile uint16_t _loc_OsrSum[ADC_SCAN_CHANNELS];
+static volatile uint8_t _loc_OsrCnt[ADC_SCAN_CHANNELS];
+
+// Zustand der Filter pro Kanal
+// _loc_FiltSum: Akkumulator des EMA bzw. laufende Summe des Boxcar
+// _loc_FiltHist: letzte Werte fr Boxcar und Median
+// _loc_FiltIdx: Schreibindex in _loc_FiltHist, Bit 7 = Filter noch nicht gestartet
+#define ADC_FILT_START 0x80
+static volatile uint16_t _loc_FiltSum[ADC_SCAN_CHANNELS];
+static volatile uint16_t _loc_FiltHist[ADC_SCAN_CHANNELS][ADC_FILT_TAPS_MAX];
+static volatile uint8_t _loc_FiltIdx[ADC_SCAN_CHANNELS];
 static volatile uint8_t _loc_ScanCnt = 0;
-static volatile uint8_t _loc_StepCnt = 0;
 static volatile uint8_t _loc_SampleCnt = 0;
+
+// Zustand der Wandlungs-Pipeline (siehe _loc_ScanSchedule)
+static volatile uint8_t _loc_RunTag = 0;
+static volatile uint8_t _loc_MuxTag = 0;
+static volatile uint8_t _loc_MuxRemain = 0;
+static volatile uint8_t _loc_NewPass = 0;
+
+// Trigger-Quelle des ADC (ADC_TRIG_x)
+static volatile uint8_t _loc_TrigSource = ADC_TRIG_FREE;
+
+// Eintrag der Scan-Tabelle fr die Bandgap (0xff = keiner) und der zuletzt umgerechnete Wert
+static uint8_t _loc_VbgScanId = 0xff;
+static uint16_t _loc_VbgLast = 0;
+
+static void _loc_ScanPrepare(void);
+
+// Doppelpuffer fr den Snapshot aller Kanle
+// _loc_SnapCnt wird nach jedem kompletten Scan erhht, der gltige Puffer ist _loc_Snapshot[_loc_SnapCnt&0x01]
+// Die ISR schreibt immer in den anderen Puffer und muss dadurch nie auf die App warten
+static volatile adc_Snapshot_t _loc_Snapshot[2];
+static volatile uint8_t _loc_SnapCnt = 0;
+static volatile uint16_t _loc_SnapSeqNr = 0;
+
+// Zeitbasis fr den Snapshot: Anzahl Wandlungen seit Start
+static volatile uint16_t _loc_ConvCnt = 0;
+
+#ifdef ADCEVENTQUEUE
+// Queue der Events (ein Schreiber: ISR, ein Leser: Hauptprogramm)
+// _loc_EvtHead wird nur von der ISR, _loc_EvtTail nur vom Hauptprogramm geschrieben,
+// beide sind 8 Bit und werden dadurch ohne Sperre gelesen
+static volatile adc_Event_t _loc_EvtQueue[ADC_EVT_QUEUE_LEN];
+static volatile uint8_t _loc_EvtHead = 0;
+static volatile uint8_t _loc_EvtTail = 0;
+static volatile uint8_t _loc_EvtLost = 0;
+#endif
+
+#ifdef ADCCALIB
+// Kalibrierung pro Kanal, Kopie des EEPROMs im RAM
+// _loc_CalibMax: grsster Wert in der Auflsung des Kanals, das Ergebnis wird darauf begrenzt
+static adc_Calib_t EEMEM _loc_CalibEe[ADC_SCAN_CHANNELS];
+static volatile adc_Calib_t _loc_Calib[ADC_SCAN_CHANNELS];
+static volatile uint16_t _loc_CalibMax[ADC_SCAN_CHANNELS];
+#endif
+
+#ifdef ADCCAPTURE
+// Ringpuffer der Burst-Aufzeichnung
+// _loc_CaptWr: nchste Schreibposition, _loc_CaptFill: Anzahl gltiger Werte
+// _loc_CaptPost: noch aufzuzeichnende Werte nach dem Trigger
+static volatile uint16_t _loc_CaptBuf[ADC_CAPT_LEN];
+static volatile uint16_t _loc_CaptWr = 0;
+static volatile uint16_t _loc_CaptFill = 0;
+static volatile uint16_t _loc_CaptPre = 0;
+static volatile uint16_t _loc_CaptPost = 0;
+static volatile uint8_t _loc_CaptStatus = ADC_CAPT_IDLE;
+static volatile uint8_t _loc_CaptIdA = 0;
+static volatile uint8_t _loc_CaptIdB = 0;
+static volatile uint8_t _loc_CaptEvent = ADC_CAPT_NOEVT;
+static volatile uint8_t _loc_CaptExcl = 0;
+#endif
+
+#ifdef ADCINJECT
+// Eingeschobene Wandlung
+// _loc_InjMux: ADMUX der angeforderten, _loc_InjRunMux: ADMUX der geplanten Wandlung
+static volatile uint8_t _loc_InjReq = 0;
+static volatile uint8_t _loc_InjMux = 0;
+static volatile uint8_t _loc_InjRunMux = 0;
+static volatile uint16_t _loc_InjValue = 0;
+static volatile uint8_t _loc_InjAdSel = 0;
+static volatile uint8_t _loc_InjCnt = 0;
+#endif
 #endif
 
 
@@ -180,12 +269,6 @@ void _loc_adc_setref(uint8_t AdcVref)
 
 #ifdef ADCFUNCTION
 
-#define ADC_STEP_READ 0
-#define ADC_STEP_MUX 1
-#define ADC_STEP_WAIT 2
-
-static volatile uint16_t _loc_AdcValueNow;
-
 
 
 uint8_t _loc_adc_Init_Int(uint8_t ClkDiv)
@@ -194,10 +277,10 @@ uint8_t _loc_adc_Init_Int(uint8_t ClkDiv)
 	// disable digital read on all analog pins
 	//DIDR0&=0xff;
 	
-	// set ADMUX to: Vcc as Reference, Left adjusted result for 8 Bit readout, Muxer according to Channel
-	// ADMUX wird auf das erste Scan-Pattern gesetzt
-	ADMUX=0;
-	ADMUX|=_loc_MuxData[0];
+	// ADMUX wird auf den ersten Eintrag der Scan-Tabelle gesetzt
+	// Es wird nur der Free Running Mode untersttzt
+	_loc_TrigSource=ADC_TRIG_FREE;
+	_loc_ScanPrepare();
 	
 	// Set Free Running Mode
 	// ADCSRB=0;
@@ -207,6 +290,8 @@ uint8_t _loc_adc_Init_Int(uint8_t ClkDiv)
 	ADCSRA|=0b10101000 | (ClkDiv);
 	ADCSRA|=0b01000000;
 
+	Adc_Status=ADC_STAT_READY;
+	return ADC_ERR_OK;
 }
 
 void _loc_adc_ConfigChannel_Int(uint8_t ScanId, uint8_t AdSel, uint8_t VrefSel, uint16_t TrigPos, uint16_t TrigNeg, uint8_t Hyst)
@@ -221,138 +306,6 @@ void _loc_adc_ConfigChannel_Int(uint8_t ScanId, uint8_t AdSel, uint8_t VrefSel,
 }
 
 
-// Hier folgt die Interrupt Routine
-// Gemss den konfigurierten Daten werden nacheinander die Kanle abgefragt
-// wobei jeweils die erste Wandlung verworfen wird, da die Signale noch nicht
-// Stabil sind.
-ISR(ADC_vect)
-{
-
-	uint16_t myOldValue;
-	uint16_t myThreshold;
-	
-	switch(_loc_StepCnt)
-	{
-		
-		case ADC_STEP_READ:
-		// Stabile Daten knnen gelesen werden
-		
-		// Gewandelter Wert lesen und ablegen
-		_loc_AdcValueNow=ADC;
-		
-		// -------------------------------------------------------------------------------------------------
-		// -------------------------------------------------------------------------------------------------
-		// Trigger State Machine ausfhren und die Callback der App aufrufen
-		myOldValue=_loc_ScanData[_loc_ScanCnt];
-		
-		switch(_loc_TrigStatus[_loc_ScanCnt])
-		{
-			case TRIG_STATUS_WAIT:
-			
-			// Check for positive Trigger
-			if((myOldValue<_loc_TrigData_Pos[_loc_ScanCnt])&&(_loc_AdcValueNow>=_loc_TrigData_Pos[_loc_ScanCnt]))
-			{
-				_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_POS;
-				// Execute Positive Trigger Event
-				adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_POS);
-			}
-			
-			// Check for negative Trigger
-			if((myOldValue>_loc_TrigData_Neg[_loc_ScanCnt])&&(_loc_AdcValueNow<=_loc_TrigData_Neg[_loc_ScanCnt]))
-			{
-				_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_NEG;
-				// Execute Positive Trigger Event
-				adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_NEG);
-			}
-			break;
-			
-			case TRIG_STATUS_NEG:
-			// Check for positive going Hysteresis Transition vom Neg Trigger
-			myThreshold=_loc_TrigData_Neg[_loc_ScanCnt]+_loc_HystData[_loc_ScanCnt];
-			if((myOldValue<myThreshold)&&(_loc_AdcValueNow>=myThreshold))
-			{
-				_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_WAIT;
-				// Execute Positive Trigger Event
-				adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_EXIT_NEG);
-			}
-			break;
-			
-			case TRIG_STATUS_POS:
-			// Check for negative going Hysteresis Transition
-			myThreshold=_loc_TrigData_Pos[_loc_ScanCnt]-_loc_HystData[_loc_ScanCnt];
-			if((myOldValue>myThreshold)&&(_loc_AdcValueNow<=myThreshold))
-			{
-				_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_WAIT;
-				// Execute Positive Trigger Event
-				adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_EXIT_POS);
-			}
-			break;
-			
-			case TRIG_STATUS_INIT:
-			if (_loc_SampleCnt>=20)
-			{
-				_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_WAIT;
-				// Execute Positive Trigger Event
-				adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_WAIT);
-			}
-			break;
-			
-			default:
-			_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_WAIT;
-			break;
-		}
-		
-		// ALte Version:
-		//if((myOldValue<_loc_TrigData_Pos[_loc_ScanCnt])&&(_loc_AdcValueNow>=_loc_TrigData_Pos[_loc_ScanCnt]))
-		//{
-		//// Execute Positive Trigger Event
-		//adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_POS);
-		//}
-		//
-		//if((myOldValue>_loc_TrigData_Neg[_loc_ScanCnt])&&(_loc_AdcValueNow<=_loc_TrigData_Neg[_loc_ScanCnt]))
-		//{
-		//// Execute Positive Trigger Event
-		//adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_NEG);
-		//}
-		// -------------------------------------------------------------------------------------------------
-		// -------------------------------------------------------------------------------------------------
-		// Ende der Triggerung
-		// -------------------------------------------------------------------------------------------------
-		
-		// Neuen Wert Speichern
-		_loc_ScanData[_loc_ScanCnt]=_loc_AdcValueNow;
-		
-		// Scan Counter erhhen und begrenzen. Sample Cnt erhhen
-		_loc_ScanCnt++;
-		if(_loc_ScanCnt>=ADC_SCAN_CHANNELS)
-		{
-			_loc_ScanCnt=0;
-			_loc_SampleCnt++;
-		}
-		
-		// Multiplexer auf die nchsten Settings umschalten
-		ADMUX=_loc_MuxData[_loc_ScanCnt];
-		
-		// nchster Step ist warten
-		_loc_StepCnt=ADC_STEP_MUX;
-		break;
-		
-		case ADC_STEP_MUX:
-		// diese Wandlung wird einfach verworfen
-		_loc_StepCnt=ADC_STEP_WAIT;
-		break;
-		
-		case ADC_STEP_WAIT:
-		// diese Wandlung wird verworfen
-		_loc_StepCnt=ADC_STEP_READ;
-		break;
-		
-		default:
-		_loc_StepCnt=ADC_STEP_READ;
-		break;
-	}
-
-}
 #endif
 
 
@@ -589,16 +542,118 @@ void _loc_adc_close()
 {
 	ADCSRA=0x00;
 	Adc_Status=ADC_STAT_CLOSED;
-	return ADC_ERR_OK;	
 }
 
-#ifdef ADCFUNCTION
+// Wechseln der Referenzspannung, AdcVref wie bei _loc_adc_init
+void _loc_adc_setref(uint8_t AdcVref)
+{
+	ADMUX&=0b00111111;
+	ADMUX|=(AdcVref & 0x03)<<6;
+	
+	// Process internal Data
+	switch (AdcVref)
+	{
+		case ADC_VREF_110:
+			_Vref_mV=1100;
+			break;
+		default:
+			_Vref_mV=_Vcc_mV;
+			break;
+	}
+}
 
-#define ADC_STEP_READ 0
-#define ADC_STEP_MUX 1
-#define ADC_STEP_WAIT 2
+#ifdef COMPFUNCTION
+ISR(ANA_COMP_vect)
+{
+	adc_CompFunction();
+}
+#endif
 
-static volatile uint16_t _loc_AdcValueNow;
+// Komparator konfigurieren
+void _loc_comp_init(uint8_t NinvSelect, uint8_t InvSelect, uint8_t IntSelect)
+{
+	
+	// Interrupt whrend der Umstellung sperren, ein Wechsel der Eingnge kann das Flag setzen
+	ACSR&=~(1<<ACIE);
+	
+	// Komparator aktivieren
+	ACSR&=~(1<<ACD);
+	
+	// NINV Eingang konfigurieren
+	switch(NinvSelect)
+	{
+		case ADC_COMP_NINV_VBG:
+			ACSR|=(1<<ACBG);
+			break;
+		case ADC_COMP_NINV_AIN0:
+			ACSR&=~(1<<ACBG);
+			// Digitalen Eingang von AIN0 abschalten
+			DIDR1|=(1<<AIN0D);
+			break;
+		default:
+			break;					
+	}
+
+	// INV Eingang Konfigurieren
+	switch(InvSelect)
+	{
+		case ADC_COMP_INV_AIN1:
+			ADCSRB&=~(1<<ACME);
+			// Digitalen Eingang von AIN1 abschalten
+			DIDR1|=(1<<AIN1D);
+			break;	
+		case ADC_COMP_INV_A0:
+		case ADC_COMP_INV_A1:
+		case ADC_COMP_INV_A2:
+		case ADC_COMP_INV_A3:
+		case ADC_COMP_INV_A4:
+		case ADC_COMP_INV_A5:
+		case ADC_COMP_INV_A6:
+		case ADC_COMP_INV_A7:
+		case ADC_COMP_INV_GND:
+		case ADC_COMP_INV_VBG:
+			ADCSRB|=(1<<ACME);
+			ADCSRA&=~(1<<ADEN);
+			Adc_Status=ADC_STAT_CLOSED;
+			ADMUX&=0b11110000;
+			ADMUX|=InvSelect;
+			break;
+		default:
+		break;
+	}
+	
+	// Input Capture von Timer1 durch den Komparator
+	if(IntSelect&ADC_COMP_INT_CAPT) ACSR|=(1<<ACIC);
+	else ACSR&=~(1<<ACIC);
+	
+	// Flanke einstellen, danach das durch die Umstellung gesetzte Flag lschen
+	switch(IntSelect&0x03)
+	{
+		case ADC_COMP_INT_RISING:
+			ACSR|=(1<<ACIS1)|(1<<ACIS0);
+			break;
+
+		case ADC_COMP_INT_FALLING:
+			ACSR&=~(1<<ACIS0);
+			ACSR|=(1<<ACIS1);
+			break;		
+	
+		default:
+			ACSR&=~((1<<ACIS1)|(1<<ACIS0));
+			break;	
+	}
+	ACSR|=(1<<ACI);
+	
+	if((IntSelect&0x03)!=ADC_COMP_INT_NONE) ACSR|=(1<<ACIE);
+}
+
+uint8_t _loc_adc_get_comp(void)
+{
+	if(ACSR&(1<<ACO)) return 1;
+	else return 0; 
+}
+
+#ifdef ADCFUNCTION
 
 
 
@@ -608,19 +663,23 @@ uint8_t _loc_adc_Init_Int(uint8_t ClkDiv)
 		// disable digital read on all analog pins
 		DIDR0&=0xff;
 		
-		// set ADMUX to: Vcc as Reference, Left adjusted result for 8 Bit readout, Muxer according to Channel
-		// ADMUX wird auf das erste Scan-Pattern gesetzt
-		ADMUX=0;
-		ADMUX|=_loc_MuxData[0];
+		// ADMUX wird auf den ersten Eintrag der Scan-Tabelle gesetzt
+		_loc_ScanPrepare();
 		
-		// Set Free Running Mode
-		ADCSRB=0;
+		// Trigger-Quelle setzen: Free Running Mode oder Timer (PWM-synchron)
+		ADCSRB=_loc_TrigSource&0x07;
 
-		// ADC Einschalten, erste Wandlung starten, Interrupt enable, Auto Trigger enable, Prescaler gemss ClkDiv
+		// ADC Einschalten, Interrupt enable, Auto Trigger enable, Prescaler gemss ClkDiv
 		ADCSRA=0;
 		ADCSRA|=0b10101000 | (ClkDiv);
-		ADCSRA|=0b01000000;			
+		
+		// Im Free Running Mode muss die erste Wandlung gestartet werden, sonst startet sie der Trigger
+		if(_loc_TrigSource==ADC_TRIG_FREE) ADCSRA|=0b01000000;
 
+		// Die synchronen Lesefunktionen (adc_Read_8 etc.) drfen ab hier nicht mehr verwendet werden,
+		// da sie den Multiplexer umschalten. Die Werte werden ber adc_Read_Value_Int gelesen.
+		Adc_Status=ADC_STAT_READY;
+		return ADC_ERR_OK;
 }
 
 void _loc_adc_ConfigChannel_Int(uint8_t ScanId, uint8_t AdSel, uint8_t VrefSel, uint16_t TrigPos, uint16_t TrigNeg, uint8_t Hyst)
@@ -637,138 +696,6 @@ void _loc_adc_ConfigChannel_Int(uint8_t ScanId, uint8_t AdSel, uint8_t VrefSel,
 }
 
 
-// Hier folgt die Interrupt Routine
-// Gemss den konfigurierten Daten werden nacheinander die Kanle abgefragt
-// wobei jeweils die erste Wandlung verworfen wird, da die Signale noch nicht
-// Stabil sind.
-ISR(ADC_vect)
-{
-
-	uint16_t myOldValue;
-	uint16_t myThreshold;
-	
-	switch(_loc_StepCnt)
-	{
-		
-		case ADC_STEP_READ:
-			// Stabile Daten knnen gelesen werden
-		
-			// Gewandelter Wert lesen und ablegen
-			_loc_AdcValueNow=ADC;
-				
-			// -------------------------------------------------------------------------------------------------	
-			// -------------------------------------------------------------------------------------------------	
-			// Trigger State Machine ausfhren und die Callback der App aufrufen			
-			myOldValue=_loc_ScanData[_loc_ScanCnt];
-			
-			switch(_loc_TrigStatus[_loc_ScanCnt])
-			{
-				case TRIG_STATUS_WAIT:
-				
-					// Check for positive Trigger
-					if((myOldValue<_loc_TrigData_Pos[_loc_ScanCnt])&&(_loc_AdcValueNow>=_loc_TrigData_Pos[_loc_ScanCnt]))
-					{
-						_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_POS;
-						// Execute Positive Trigger Event
-						adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_POS);
-					}
-					
-					// Check for negative Trigger
-					if((myOldValue>_loc_TrigData_Neg[_loc_ScanCnt])&&(_loc_AdcValueNow<=_loc_TrigData_Neg[_loc_ScanCnt]))
-					{
-						_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_NEG;
-						// Execute Positive Trigger Event
-						adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_NEG);
-					}
-					break;
-					
-				case TRIG_STATUS_NEG:
-					// Check for positive going Hysteresis Transition vom Neg Trigger
-					myThreshold=_loc_TrigData_Neg[_loc_ScanCnt]+_loc_HystData[_loc_ScanCnt];
-					if((myOldValue<myThreshold)&&(_loc_AdcValueNow>=myThreshold))
-					{
-						_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_WAIT;
-						// Execute Positive Trigger Event
-						adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_EXIT_NEG);
-					}				
-					break;
-					
-				case TRIG_STATUS_POS:
-					// Check for negative going Hysteresis Transition
-					myThreshold=_loc_TrigData_Pos[_loc_ScanCnt]-_loc_HystData[_loc_ScanCnt];
-					if((myOldValue>myThreshold)&&(_loc_AdcValueNow<=myThreshold))
-					{
-						_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_WAIT;
-						// Execute Positive Trigger Event
-						adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_EXIT_POS);
-					}
-					break;					
-					
-				case TRIG_STATUS_INIT:
-					if (_loc_SampleCnt>=20)
-					{
-						_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_WAIT;
-						// Execute Positive Trigger Event
-						adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_WAIT);						
-					}	
-					break;
-						
-				default:
-					_loc_TrigStatus[_loc_ScanCnt]=TRIG_STATUS_WAIT;
-					break;
-			}
-			
-			// ALte Version:
-			//if((myOldValue<_loc_TrigData_Pos[_loc_ScanCnt])&&(_loc_AdcValueNow>=_loc_TrigData_Pos[_loc_ScanCnt]))
-			//{
-				//// Execute Positive Trigger Event
-				//adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_POS);				
-			//}
-		//
-			//if((myOldValue>_loc_TrigData_Neg[_loc_ScanCnt])&&(_loc_AdcValueNow<=_loc_TrigData_Neg[_loc_ScanCnt]))
-			//{
-				//// Execute Positive Trigger Event
-				//adc_AdcFunction(_loc_ScanCnt, ADC_EVT_TRIG_NEG);			
-			//}		
-			// -------------------------------------------------------------------------------------------------
-			// -------------------------------------------------------------------------------------------------
-			// Ende der Triggerung
-			// -------------------------------------------------------------------------------------------------			
-			
-			// Neuen Wert Speichern
-			_loc_ScanData[_loc_ScanCnt]=_loc_AdcValueNow;		
-		
-			// Scan Counter erhhen und begrenzen. Sample Cnt erhhen
-			_loc_ScanCnt++;
-			if(_loc_ScanCnt>=ADC_SCAN_CHANNELS)
-			{
-				 _loc_ScanCnt=0;
-				 _loc_SampleCnt++;
-			}
-				
-			// Multiplexer auf die nchsten Settings umschalten
-			ADMUX=_loc_MuxData[_loc_ScanCnt];		
-		 
-			// nchster Step ist warten 
-			_loc_StepCnt=ADC_STEP_MUX;
-			break;
-	
-		case ADC_STEP_MUX:	
-			// diese Wandlung wird einfach verworfen	
-			_loc_StepCnt=ADC_STEP_WAIT;
-			break;
-		
-		case ADC_STEP_WAIT:	
-			// diese Wandlung wird verworfen
-			_loc_StepCnt=ADC_STEP_READ;
-			break;
-		
-		default:
-			_loc_StepCnt=ADC_STEP_READ;
-			break;
-		}
-
-}
 #endif
 
 
@@ -863,18 +790,524 @@ void _loc_adc_close()
 {
 	ADCSRA=0x00;
 	Adc_Status=ADC_STAT_CLOSED;
-	return ADC_ERR_OK;
 }
 
 #endif
 
+#ifdef ADCFUNCTION
+//-------------------------------------------------------------------
+// Interrupt-gesteuerter Scan, fr alle Devices identisch
+
+// Jede Wandlung bekommt beim Planen ein Tag:
+// Bit 7: Ergebnis wird gelesen (sonst Einschwing-Wandlung, wird verworfen)
+// Bit 6: erste gelesene Wandlung eines neuen Durchlaufs
+// Bit 5..0: ScanId
+// Bit 6 ohne Bit 7: eingeschobene Wandlung (ADCINJECT)
+#define ADC_TAG_READ 0x80
+#define ADC_TAG_NEWPASS 0x40
+#define ADC_TAG_ID 0x3f
+#define ADC_TAG_INJ ADC_TAG_NEWPASS
+
+static volatile uint16_t _loc_AdcValueNow;
+
+// Plant die nchste Wandlung, die mit einem neuen ADMUX Wert gestartet werden kann
+// Im Free Running Mode ist beim Interrupt die nchste Wandlung bereits gestartet,
+// ein neuer ADMUX Wert wirkt deshalb erst auf die bernchste Wandlung.
+// Mit Timer-Trigger startet die nchste Wandlung erst beim nchsten Trigger.
+// Rckgabewert ist das Tag der geplanten Wandlung
+static uint8_t _loc_ScanSchedule(void)
+{
+	uint8_t myTag;
+	uint8_t myRateDiv;
+	uint8_t i;
+	
+#ifdef ADCINJECT
+	// Eingeschobene Wandlung hat Vorrang, der Scan-Eintrag bleibt stehen
+	// Ein laufendes Einschwingen beginnt danach mit allen Einschwing-Wandlungen von vorne
+	if(_loc_InjReq)
+	{
+		_loc_InjReq=0;
+		_loc_InjRunMux=_loc_InjMux;
+		ADMUX=_loc_InjMux;
+		if(_loc_MuxRemain) _loc_MuxRemain=pgm_read_byte(&_loc_ScanTable[_loc_ScanCnt].Discard)+1;
+		return ADC_TAG_INJ;
+	}
+#endif
+	
+	if(_loc_MuxRemain)
+	{
+		// Kanal bleibt, weitere Einschwing-Wandlung
+		_loc_MuxRemain--;
+#ifdef ADCINJECT
+		ADMUX=_loc_MuxData[_loc_ScanCnt];	//Nach einer eingeschobenen Wandlung zurckschalten
+#endif
+	}
+#ifdef ADCCAPTURE
+	else if(_loc_CaptExcl&&((_loc_CaptStatus==ADC_CAPT_ARMED)||(_loc_CaptStatus==ADC_CAPT_POST)))
+	{
+		// Exklusive Aufzeichnung: nur die beiden Eintrge abwechselnd wandeln, RateDiv gilt nicht
+		// Jeder Wechsel auf ScanIdA beginnt einen neuen Durchlauf, damit der Snapshot weiterluft
+		if(_loc_ScanCnt==_loc_CaptIdA)
+		{
+			_loc_ScanCnt=_loc_CaptIdB;
+		}
+		else
+		{
+			_loc_ScanCnt=_loc_CaptIdA;
+			_loc_NewPass=1;
+		}
+		
+		// Ein Kanal ohne Umschalten braucht keine Einschwing-Wandlung
+		if(ADMUX!=_loc_MuxData[_loc_ScanCnt])
+		{
+			ADMUX=_loc_MuxData[_loc_ScanCnt];
+			_loc_MuxRemain=pgm_read_byte(&_loc_ScanTable[_loc_ScanCnt].Discard);
+		}
+	}
+#endif
+	else
+	{
+		// nchsten flligen Eintrag suchen, hchstens ein Durchlauf durch die Tabelle
+		for(i=0;i<_loc_ScanLen;i++)
+		{
+			_loc_ScanCnt++;
+			if(_loc_ScanCnt>=_loc_ScanLen)
+			{
+				_loc_ScanCnt=0;
+				_loc_NewPass=1;
+			}
+			
+			if(_loc_RateCnt[_loc_ScanCnt]==0)
+			{
+				myRateDiv=pgm_read_byte(&_loc_ScanTable[_loc_ScanCnt].RateDiv);
+				if(myRateDiv) myRateDiv--;
+				_loc_RateCnt[_loc_ScanCnt]=myRateDiv;
+				break;
+			}
+			_loc_RateCnt[_loc_ScanCnt]--;
+		}
+		
+		// Multiplexer auf die nchsten Settings umschalten
+		ADMUX=_loc_MuxData[_loc_ScanCnt];
+		_loc_MuxRemain=pgm_read_byte(&_loc_ScanTable[_loc_ScanCnt].Discard);
+	}
+	
+	myTag=_loc_ScanCnt;
+	if(_loc_MuxRemain==0)
+	{
+		myTag|=ADC_TAG_READ;
+		if(_loc_NewPass)
+		{
+			myTag|=ADC_TAG_NEWPASS;
+			_loc_NewPass=0;
+		}
+	}
+	return myTag;
+}
+
+// Filter eines Kanals auf einen neuen Wert anwenden, nur Integer-Arithmetik
+// Beim ersten Wert wird der Filterzustand mit diesem Wert geladen, damit der Ausgang nicht von 0 aus einschwingt
+static inline uint16_t _loc_Filter(uint8_t ScanId, uint16_t Value)
+{
+	uint8_t myPar;
+	uint8_t myIdx;
+	uint8_t myTaps;
+	uint8_t i;
+	uint16_t myA;
+	uint16_t myB;
+	uint16_t myC;
+	
+	myPar=pgm_read_byte(&_loc_ScanTable[ScanId].FiltPar);
+	myIdx=_loc_FiltIdx[ScanId];
+	
+	switch(pgm_read_byte(&_loc_ScanTable[ScanId].Filter))
+	{
+		case ADC_FILT_EMA:
+			// y = y + (x-y)/2^k, der Akkumulator enthlt y*2^k
+			myPar&=0x07;
+			if(myIdx&ADC_FILT_START)
+			{
+				_loc_FiltSum[ScanId]=Value<<myPar;
+				_loc_FiltIdx[ScanId]=0;
+			}
+			_loc_FiltSum[ScanId]-=_loc_FiltSum[ScanId]>>myPar;
+			_loc_FiltSum[ScanId]+=Value;
+			return _loc_FiltSum[ScanId]>>myPar;
+			
+		case ADC_FILT_BOX:
+			// gleitender Mittelwert ber 2^k Werte mit laufender Summe
+			myPar&=0x03;
+			myTaps=1<<myPar;
+			if(myIdx&ADC_FILT_START)
+			{
+				for(i=0;i<myTaps;i++) _loc_FiltHist[ScanId][i]=Value;
+				_loc_FiltSum[ScanId]=Value<<myPar;
+				myIdx=0;
+			}
+			_loc_FiltSum[ScanId]+=Value;
+			_loc_FiltSum[ScanId]-=_loc_FiltHist[ScanId][myIdx];
+			_loc_FiltHist[ScanId][myIdx]=Value;
+			_loc_FiltIdx[ScanId]=(myIdx+1)&(myTaps-1);
+			return _loc_FiltSum[ScanId]>>myPar;
+			
+		case ADC_FILT_MED3:
+			// Median aus dem neuen und den beiden letzten Werten, unterdrckt einzelne Spitzen
+			if(myIdx&ADC_FILT_START)
+			{
+				_loc_FiltHist[ScanId][0]=Value;
+				_loc_FiltHist[ScanId][1]=Value;
+				_loc_FiltIdx[ScanId]=0;
+			}
+			myA=_loc_FiltHist[ScanId][0];
+			myB=_loc_FiltHist[ScanId][1];
+			_loc_FiltHist[ScanId][1]=myA;
+			_loc_FiltHist[ScanId][0]=Value;
+			// myA und myB sortieren, danach liegt der Median zwischen myA und myB
+			if(myA>myB)
+			{
+				myC=myA;
+				myA=myB;
+				myB=myC;
+			}
+			if(Value<=myA) return myA;
+			if(Value>=myB) return myB;
+			return Value;
+			
+		default:
+			return Value;
+	}
+}
+
+#ifdef ADCCAPTURE
+// Aufzeichnung auslsen, PreTrig Werte sind bereits im Puffer
+static inline void _loc_CaptTrigger(void)
+{
+	if(_loc_CaptStatus!=ADC_CAPT_ARMED) return;
+	_loc_CaptPre=_loc_CaptFill;
+	_loc_CaptPost=ADC_CAPT_LEN-_loc_CaptPre;
+	_loc_CaptStatus=ADC_CAPT_POST;
+}
+
+// Roh-Wandlung in den Ringpuffer schreiben
+// Vor dem Trigger wird nur bis PreTrig gefllt, die ltesten Werte werden berschrieben
+static inline void _loc_CaptStore(uint8_t ScanId, uint16_t Value)
+{
+	if((_loc_CaptStatus!=ADC_CAPT_ARMED)&&(_loc_CaptStatus!=ADC_CAPT_POST)) return;
+	if((ScanId!=_loc_CaptIdA)&&(ScanId!=_loc_CaptIdB)) return;
+	
+	_loc_CaptBuf[_loc_CaptWr]=Value|((uint16_t)ScanId<<12);
+	_loc_CaptWr=(_loc_CaptWr+1)&(ADC_CAPT_LEN-1);
+	
+	if(_loc_CaptStatus==ADC_CAPT_ARMED)
+	{
+		if(_loc_CaptFill<_loc_CaptPre) _loc_CaptFill++;
+	}
+	else
+	{
+		_loc_CaptFill++;
+		_loc_CaptPost--;
+		if(_loc_CaptPost==0) _loc_CaptStatus=ADC_CAPT_DONE;
+	}
+}
+#endif
+
+#ifdef ADCCALIB
+// Offset und Verstrkung eines Kanals korrigieren
+// (x*2)*Gain/2^16 statt x*Gain/2^15: das Ergebnis ist das obere Wort des Produkts,
+// dadurch entfllt das Schieben um 15 Bit (x*2 passt bei hchstens 13 Bit in 16 Bit)
+static inline uint16_t _loc_Calibrate(uint8_t ScanId, uint16_t Value)
+{
+	int16_t myValue;
+	
+	myValue=(int16_t)Value-_loc_Calib[ScanId].Offset;
+	if(myValue<=0) return 0;
+	Value=((uint32_t)((uint16_t)myValue<<1)*_loc_Calib[ScanId].Gain)>>16;
+	if(Value>_loc_CalibMax[ScanId]) return _loc_CalibMax[ScanId];
+	return Value;
+}
+
+// Kalibrierung aus dem EEPROM laden, gelschte Eintrge werden nicht korrigiert
+static void _loc_CalibLoad(void)
+{
+	uint8_t i;
+	
+	eeprom_read_block((void *)_loc_Calib, _loc_CalibEe, sizeof(_loc_Calib));
+	for(i=0;i<ADC_SCAN_CHANNELS;i++)
+	{
+		if(_loc_Calib[i].Gain==ADC_CALIB_GAIN_INVALID)
+		{
+			_loc_Calib[i].Offset=0;
+			_loc_Calib[i].Gain=ADC_CALIB_GAIN_ONE;
+		}
+		if(i<_loc_ScanLen) _loc_CalibMax[i]=(0x0400<<(pgm_read_byte(&_loc_ScanTable[i].OsrBits)&0x03))-1;
+		else _loc_CalibMax[i]=0x03ff;
+	}
+}
+#endif
+
+// Event an die App weitergeben
+// Ein Event des Kanals ScanIdA kann zustzlich die Aufzeichnung auslsen
+static inline void _loc_AdcEvent(uint8_t ScanId, uint8_t EventId)
+{
+#ifdef ADCEVENTQUEUE
+	uint8_t myHead;
+#endif
+	
+#ifdef ADCCAPTURE
+	if((ScanId==_loc_CaptIdA)&&(EventId==_loc_CaptEvent)) _loc_CaptTrigger();
+#endif
+#ifdef ADCEVENTQUEUE
+	// Der Eintrag wird zuerst geschrieben und erst danach mit dem neuen Head freigegeben
+	myHead=(_loc_EvtHead+1)&(ADC_EVT_QUEUE_LEN-1);
+	if(myHead==_loc_EvtTail)
+	{
+		if(_loc_EvtLost<0xff) _loc_EvtLost++;
+		return;
+	}
+	_loc_EvtQueue[_loc_EvtHead].ScanId=ScanId;
+	_loc_EvtQueue[_loc_EvtHead].EventId=EventId;
+	_loc_EvtQueue[_loc_EvtHead].Value=_loc_AdcValueNow;
+	_loc_EvtQueue[_loc_EvtHead].TimeStamp=_loc_ConvCnt;
+	_loc_EvtHead=myHead;
+#else
+	adc_AdcFunction(ScanId, EventId);
+#endif
+}
+
+// Scan vor dem Starten des ADC vorbereiten
+// ADMUX wird auf den ersten Eintrag gesetzt.
+// Im Free Running Mode wird die erste Wandlung nach dem Einschalten verworfen
+static void _loc_ScanPrepare(void)
+{
+	uint8_t i;
+	
+	for(i=0;i<ADC_SCAN_CHANNELS;i++)
+	{
+		_loc_RateCnt[i]=0;
+		_loc_OsrSum[i]=0;
+		_loc_OsrCnt[i]=0;
+		_loc_FiltIdx[i]=ADC_FILT_START;
+		_loc_TrigStatus[i]=TRIG_STATUS_INIT;
+	}
+	_loc_ScanCnt=_loc_ScanLen-1;
+	_loc_MuxRemain=0;
+	_loc_SampleCnt=0;
+#ifdef ADCINJECT
+	_loc_InjReq=0;
+#endif
+	
+	if(_loc_TrigSource==ADC_TRIG_FREE)
+	{
+		_loc_RunTag=0;
+		_loc_MuxTag=_loc_ScanSchedule()&~ADC_TAG_NEWPASS;
+	}
+	else
+	{
+		_loc_RunTag=_loc_ScanSchedule()&~ADC_TAG_NEWPASS;
+	}
+	_loc_NewPass=0;
+}
+
+// Hier folgt die Interrupt Routine
+// Gemss der Scan-Tabelle werden nacheinander die Kanle abgefragt.
+// Pro Kanal werden Discard Einschwing-Wandlungen verworfen, RateDiv legt fest
+// in jedem wievielten Durchlauf der Kanal gemessen wird.
+// Nach jedem kompletten Durchlauf wird der Snapshot-Puffer umgeschaltet
+ISR(ADC_vect)
+{
+	uint16_t myOldValue;
+	uint16_t myThreshold;
+	uint8_t myTag;
+	uint8_t myScanId;
+	uint8_t mySnapWrite;
+	uint8_t myOsrBits;
+	uint8_t i;
+	
+	// Zeitbasis weiterzhlen, eine Wandlung pro 13 ADC-Takte bzw. pro Trigger
+	_loc_ConvCnt++;
+	
+	// Die Planung erfolgt zuerst, damit ADMUX sicher vor dem Start der nchsten Wandlung gesetzt ist
+	myTag=_loc_RunTag;
+	if(_loc_TrigSource==ADC_TRIG_FREE)
+	{
+		// Die fertige Wandlung trgt das Tag der laufenden, die gerade gestartete das Tag des aktuellen ADMUX
+		_loc_RunTag=_loc_MuxTag;
+		_loc_MuxTag=_loc_ScanSchedule();
+	}
+	else
+	{
+		// Die nchste Wandlung startet erst mit dem nchsten Trigger und verwendet den neuen ADMUX
+		_loc_RunTag=_loc_ScanSchedule();
+		
+#ifdef DEVICE_ATMEGA328
+		// Compare Flags ohne eigene ISR lschen, sonst gibt es keine neue Flanke fr den nchsten Trigger
+		// Beim berlauf als Quelle gilt das gleiche fr das Overflow Flag. Ist die Wandlung lnger als
+		// die Timer-Periode, startet die nchste Wandlung dadurch synchron beim bernchsten Ereignis
+		if(_loc_TrigSource==ADC_TRIG_T0_COMPA) TIFR0=(1<<OCF0A);
+		if(_loc_TrigSource==ADC_TRIG_T0_OVF) TIFR0=(1<<TOV0);
+		if(_loc_TrigSource==ADC_TRIG_T1_COMPB) TIFR1=(1<<OCF1B);
+		if(_loc_TrigSource==ADC_TRIG_T1_OVF) TIFR1=(1<<TOV1);
+#endif
+	}
+	
+#ifdef ADCINJECT
+	// Eingeschobene Wandlung: nur das Ergebnis ablegen, der Scan ist davon nicht betroffen
+	if(myTag==ADC_TAG_INJ)
+	{
+		_loc_InjValue=ADC;
+		_loc_InjAdSel=_loc_InjRunMux&0x0f;
+		_loc_InjCnt++;
+		return;
+	}
+#endif
+	
+	// Einschwing-Wandlungen werden verworfen
+	if(!(myTag&ADC_TAG_READ)) return;
+	
+	// Stabile Daten knnen gelesen werden
+	_loc_AdcValueNow=ADC;
+	myScanId=myTag&ADC_TAG_ID;
+	
+#ifdef ADCCAPTURE
+	// Die Aufzeichnung erhlt die Roh-Werte mit der vollen Abtastrate des Kanals
+	_loc_CaptStore(myScanId, _loc_AdcValueNow);
+#endif
+	
+	// Ein neuer Durchlauf beginnt: den vorherigen als Snapshot verffentlichen
+	// Es wird in den Puffer geschrieben, der gerade nicht gelesen wird
+	if(myTag&ADC_TAG_NEWPASS)
+	{
+		mySnapWrite=(_loc_SnapCnt+1)&0x01;
+		for(i=0;i<_loc_ScanLen;i++)
+		{
+			_loc_Snapshot[mySnapWrite].Value[i]=_loc_ScanData[i];
+		}
+		_loc_SnapSeqNr++;
+		_loc_Snapshot[mySnapWrite].SeqNr=_loc_SnapSeqNr;
+		_loc_Snapshot[mySnapWrite].TimeStamp=_loc_ConvCnt;
+		_loc_SnapCnt++;
+		_loc_SampleCnt++;
+	}
+	
+	// Oversampling: 4^n Wandlungen aufsummieren und um n Bit dezimieren, Ergebnis hat 10+n Bit
+	// Bei n<=3 reicht ein 16-Bit Akkumulator (64*1023 < 65536)
+	myOsrBits=pgm_read_byte(&_loc_ScanTable[myScanId].OsrBits)&0x03;
+	if(myOsrBits)
+	{
+		_loc_OsrSum[myScanId]+=_loc_AdcValueNow;
+		_loc_OsrCnt[myScanId]++;
+		if(_loc_OsrCnt[myScanId]<(1<<(2*myOsrBits))) return;
+		
+		_loc_AdcValueNow=_loc_OsrSum[myScanId]>>myOsrBits;
+		_loc_OsrSum[myScanId]=0;
+		_loc_OsrCnt[myScanId]=0;
+	}
+	
+	// Filter des Kanals anwenden, die Trigger werden auf dem gefilterten Wert ausgewertet
+	_loc_AdcValueNow=_loc_Filter(myScanId, _loc_AdcValueNow);
+	
+#ifdef ADCCALIB
+	// Offset und Verstrkung korrigieren, die Trigger-Schwellen gelten fr den korrigierten Wert
+	_loc_AdcValueNow=_loc_Calibrate(myScanId, _loc_AdcValueNow);
+#endif
+	
+	// -------------------------------------------------------------------------------------------------
+	// -------------------------------------------------------------------------------------------------
+	// Trigger State Machine ausfhren und die Callback der App aufrufen
+	myOldValue=_loc_ScanData[myScanId];
+	
+	switch(_loc_TrigStatus[myScanId])
+	{
+		case TRIG_STATUS_WAIT:
+		
+			// Check for positive Trigger
+			if((myOldValue<_loc_TrigData_Pos[myScanId])&&(_loc_AdcValueNow>=_loc_TrigData_Pos[myScanId]))
+			{
+				_loc_TrigStatus[myScanId]=TRIG_STATUS_POS;
+				// Execute Positive Trigger Event
+				_loc_AdcEvent(myScanId, ADC_EVT_TRIG_POS);
+			}
+			
+			// Check for negative Trigger
+			if((myOldValue>_loc_TrigData_Neg[myScanId])&&(_loc_AdcValueNow<=_loc_TrigData_Neg[myScanId]))
+			{
+				_loc_TrigStatus[myScanId]=TRIG_STATUS_NEG;
+				// Execute Positive Trigger Event
+				_loc_AdcEvent(myScanId, ADC_EVT_TRIG_NEG);
+			}
+			break;
+			
+		case TRIG_STATUS_NEG:
+			// Check for positive going Hysteresis Transition vom Neg Trigger
+			myThreshold=_loc_TrigData_Neg[myScanId]+_loc_HystData[myScanId];
+			if((myOldValue<myThreshold)&&(_loc_AdcValueNow>=myThreshold))
+			{
+				_loc_TrigStatus[myScanId]=TRIG_STATUS_WAIT;
+				// Execute Positive Trigger Event
+				_loc_AdcEvent(myScanId, ADC_EVT_TRIG_EXIT_NEG);
+			}
+			break;
+			
+		case TRIG_STATUS_POS:
+			// Check for negative going Hysteresis Transition
+			myThreshold=_loc_TrigData_Pos[myScanId]-_loc_HystData[myScanId];
+			if((myOldValue>myThreshold)&&(_loc_AdcValueNow<=myThreshold))
+			{
+				_loc_TrigStatus[myScanId]=TRIG_STATUS_WAIT;
+				// Execute Positive Trigger Event
+				_loc_AdcEvent(myScanId, ADC_EVT_TRIG_EXIT_POS);
+			}
+			break;
+			
+		case TRIG_STATUS_INIT:
+			if (_loc_SampleCnt>=20)
+			{
+				_loc_TrigStatus[myScanId]=TRIG_STATUS_WAIT;
+				// Execute Positive Trigger Event
+				_loc_AdcEvent(myScanId, ADC_EVT_TRIG_WAIT);
+			}
+			break;
+			
+		default:
+			_loc_TrigStatus[myScanId]=TRIG_STATUS_WAIT;
+			break;
+	}
+	// -------------------------------------------------------------------------------------------------
+	// Ende der Triggerung
+	// -------------------------------------------------------------------------------------------------
+	
+	// Neuen Wert Speichern
+	_loc_ScanData[myScanId]=_loc_AdcValueNow;
+}
+#endif
+
+
 //-------------------------------------------------------------------
 // Implementierung der HW-Unabhngigen Funktionen
 
+// Vcc aus einer Wandlung der Bandgap gegen Vcc berechnen
+// Vcc = Vbg * 2^Bits / N, Bits = Auflsung der Wandlung
+static uint16_t _loc_VccFromVbg(uint16_t VbgValue, uint8_t Bits)
+{
+	if(VbgValue==0) return _Vcc_mV;
+	return (uint16_t)(((uint32_t)ADC_VBG_MV<<Bits)/VbgValue);
+}
+
+// Neue Vcc bernehmen, eine Referenz auf Vcc wird nachgefhrt
+static void _loc_SetVcc(uint16_t Vcc_mV)
+{
+	if(_Vref_mV==_Vcc_mV) _Vref_mV=Vcc_mV;
+	_Vcc_mV=Vcc_mV;
+}
+
 // konfigurieren des ADCs fr eine Referenzspannung
 uint8_t adc_Init(uint8_t AdcVref)
 {
-	return _loc_adc_init(AdcVref);
+	uint8_t myErr;
+	
+	myErr=_loc_adc_init(AdcVref);
+	if(myErr==ADC_ERR_OK) adc_Measure_Vcc();
+	return myErr;
 }
 
 // Auslesen des ADC als 8-Bit Wert
@@ -917,6 +1350,34 @@ uint16_t adc_Read_mV_Divider(uint8_t AdcChannel, uint8_t R1, uint8_t R2)
 	return AdcValue&0xffff;
 }
 
+// Vollausschlag in mV fr einen Kanal vorberechnen, die Division erfolgt nur hier
+// R2=0 bedeutet ohne Spannungsteiler
+uint8_t adc_Init_mV_Scale(adc_mVScale_t * Scale, uint16_t Vref_mV, uint8_t R1, uint8_t R2, uint8_t Bits)
+{
+	uint32_t myFullScale;
+	
+	if((Bits<10)||(Bits>16)) return ADC_ERR_STAT;
+	
+	myFullScale=Vref_mV;
+	if(R2)
+	{
+		// gerundet, damit der Fehler hchstens 1mV bei Vollausschlag betrgt
+		myFullScale=(myFullScale*(R1+R2)+(R2>>1))/R2;
+	}
+	if(myFullScale>0xffff) return ADC_ERR_STAT;
+	
+	Scale->FullScale=(uint16_t)myFullScale;
+	Scale->Shift=16-Bits;
+	return ADC_ERR_OK;
+}
+
+// Wert in mV umrechnen: der Wert wird auf 16 Bit linksbndig gestellt (Anteil am Vollausschlag Q16),
+// vom Produkt mit dem Vollausschlag wird nur das obere Wort verwendet
+uint16_t adc_Scale_mV(const adc_mVScale_t * Scale, uint16_t AdcValue)
+{
+	return ((uint32_t)(uint16_t)(AdcValue<<Scale->Shift)*Scale->FullScale)>>16;
+}
+
 // Auslesen des gerade aktuellen Kanals ohne Wartezeit. Es wird das zuletzt konvertierte Ergebnis ausgelesen
 // Danach wird der Kanal umgeschaltet. DIe Annahme ist, dass vor dem nchsten Aufruf mindestens 2 Konvertierungen komplettiert wurden
 uint16_t adc_ReadImmediateAndChange_mV_10_Divider(uint8_t NextChannel,uint8_t R1, uint8_t R2)
@@ -942,7 +1403,18 @@ void adc_SetRef(uint8_t RefSelect)
 // Schliessen des ADC fr neue Konfiguration
 void adc_Close()
 {
-	return _loc_adc_close();
+	_loc_adc_close();
+}
+
+// Vcc ber die Bandgap messen
+// Bei einer anderen Referenz als Vcc ist keine Messung mglich
+uint16_t adc_Measure_Vcc(void)
+{
+	if(_Vref_mV==_Vcc_mV)
+	{
+		_loc_SetVcc(_loc_VccFromVbg(adc_Read_10(ADC_CH_VBG), 10));
+	}
+	return _Vcc_mV;
 }
 
 // Konfigurieren des Komparators
@@ -964,6 +1436,49 @@ uint8_t adc_Get_Comp(void)
 #ifdef ADCFUNCTION
 uint8_t adc_Init_Int(uint8_t ClkDiv)
 {
+	_loc_ScanTable=_loc_DefaultScanTable;
+	_loc_ScanLen=ADC_SCAN_CHANNELS;
+#ifdef ADCCALIB
+	_loc_CalibLoad();
+#endif
+	return _loc_adc_Init_Int(ClkDiv);
+}
+
+// Trigger-Quelle fr den Interrupt-Betrieb whlen
+// Muss vor adc_Init_Int bzw. adc_Init_Scan_Int aufgerufen werden
+void adc_SetTrigger_Int(uint8_t TrigSource)
+{
+	_loc_TrigSource=TrigSource;
+}
+
+// Interrupt-Betrieb mit einer Scan-Tabelle im Flash starten
+// Referenz und Kanal werden aus der Tabelle bernommen, die Trigger knnen danach
+// mit adc_ConfigChannel_Int gesetzt werden
+uint8_t adc_Init_Scan_Int(const adc_ScanEntry_t * ScanTable, uint8_t NEntries, uint8_t ClkDiv)
+{
+	uint8_t i;
+	
+	if((NEntries==0)||(NEntries>ADC_SCAN_CHANNELS)) return ADC_ERR_STAT;
+	
+	_loc_ScanTable=ScanTable;
+	_loc_ScanLen=NEntries;
+	for(i=0;i<NEntries;i++)
+	{
+		_loc_MuxData[i]=(pgm_read_byte(&ScanTable[i].VrefSel)<<6) | (pgm_read_byte(&ScanTable[i].AdSel)&0x0f);
+		_loc_TrigData_Pos[i]=0xffff;
+		_loc_TrigData_Neg[i]=0;
+	}
+	
+	// Bandgap-Eintrag fr die Vcc-Messung suchen
+	_loc_VbgScanId=0xff;
+	_loc_VbgLast=0;
+	for(i=NEntries;i>0;i--)
+	{
+		if((pgm_read_byte(&ScanTable[i-1].AdSel)==ADC_CH_VBG)&&(pgm_read_byte(&ScanTable[i-1].VrefSel)==ADC_VREF_VCC)) _loc_VbgScanId=i-1;
+	}
+#ifdef ADCCALIB
+	_loc_CalibLoad();
+#endif
 	return _loc_adc_Init_Int(ClkDiv);
 }
 
@@ -974,10 +1489,66 @@ void adc_ConfigChannel_Int(uint8_t ScanId, uint8_t AdSel, uint8_t VrefSel, uint1
 }
 
 // Einen gewandelten Wert auslesen
+// Der 16-Bit Wert wird mit gesperrten Interrupts gelesen, damit er nicht von der ISR zerrissen wird
 uint16_t adc_Read_Value_Int(uint8_t AdSel)
 {
-	if(AdSel<ADC_SCAN_CHANNELS) return _loc_ScanData[AdSel];
-	else return 0xffff;
+	uint16_t myValue;
+	uint8_t mySreg;
+	
+	if(AdSel>=ADC_SCAN_CHANNELS) return 0xffff;
+	
+	mySreg=SREG;
+	cli();
+	myValue=_loc_ScanData[AdSel];
+	SREG=mySreg;
+	
+	return myValue;
+}
+
+// Einen gewandelten Wert als 8-Bit Wert auslesen
+// Es wird der Wert aus dem Scan verwendet, dadurch entfllt die Wartezeit von adc_Read_8
+// Die zustzlichen Bits aus dem Oversampling werden abgeschnitten
+uint8_t adc_Read_8_Int(uint8_t ScanId)
+{
+	if(ScanId<ADC_SCAN_CHANNELS) return (uint8_t)(adc_Read_Value_Int(ScanId)>>(2+(pgm_read_byte(&_loc_ScanTable[ScanId].OsrBits)&0x03)));
+	else return 0xff;
+}
+
+// Einen konsistenten Satz aller Scan-Kanle lesen
+// ndert sich der Pufferzhler whrend des Kopierens, wird die Kopie wiederholt
+// Die ISR wird dabei nie blockiert
+void adc_GetSnapshot_Int(adc_Snapshot_t * Snapshot)
+{
+	uint8_t mySnapCnt;
+	uint8_t i;
+	
+	do
+	{
+		mySnapCnt=_loc_SnapCnt;
+		for(i=0;i<ADC_SCAN_CHANNELS;i++)
+		{
+			Snapshot->Value[i]=_loc_Snapshot[mySnapCnt&0x01].Value[i];
+		}
+		Snapshot->SeqNr=_loc_Snapshot[mySnapCnt&0x01].SeqNr;
+		Snapshot->TimeStamp=_loc_Snapshot[mySnapCnt&0x01].TimeStamp;
+	} while(mySnapCnt!=_loc_SnapCnt);
+}
+
+// Vcc aus dem Bandgap-Eintrag der Scan-Tabelle
+// Der Wert wird vom Scan laufend gemessen und bleibt damit auch bei einbrechender Versorgung aktuell
+uint16_t adc_Get_Vcc_mV_Int(void)
+{
+	uint16_t myVbg;
+	
+	if(_loc_VbgScanId==0xff) return _Vcc_mV;
+	
+	myVbg=adc_Read_Value_Int(_loc_VbgScanId);
+	if(myVbg!=_loc_VbgLast)
+	{
+		_loc_VbgLast=myVbg;
+		_loc_SetVcc(_loc_VccFromVbg(myVbg, 10+(pgm_read_byte(&_loc_ScanTable[_loc_VbgScanId].OsrBits)&0x03)));
+	}
+	return _Vcc_mV;
 }
 
 // Einen gewandelten Wert in mV umrechnen
@@ -985,6 +1556,7 @@ uint16_t adc_Convert_mV_Int(int32_t AdcValue, int32_t Vref, uint8_t R1, uint8_t
 {
 	int32_t DivValue;
 	
+	if(Vref==ADC_VREF_MV_VCC) Vref=adc_Get_Vcc_mV_Int();
 	AdcValue=(Vref*AdcValue)>>10;
 	AdcValue=AdcValue*(R1+R2);
 	DivValue=R2;
@@ -992,5 +1564,170 @@ uint16_t adc_Convert_mV_Int(int32_t AdcValue, int32_t Vref, uint8_t R1, uint8_t
 	return AdcValue&0xffff;	
 }
 
+#ifdef ADCEVENTQUEUE
+// ltestes Event holen
+// Der Eintrag wird zuerst kopiert und erst danach mit dem neuen Tail fr die ISR freigegeben
+uint8_t adc_GetEvent_Int(adc_Event_t * Event)
+{
+	uint8_t myTail;
+	
+	myTail=_loc_EvtTail;
+	if(myTail==_loc_EvtHead) return 0;
+	
+	Event->ScanId=_loc_EvtQueue[myTail].ScanId;
+	Event->EventId=_loc_EvtQueue[myTail].EventId;
+	Event->Value=_loc_EvtQueue[myTail].Value;
+	Event->TimeStamp=_loc_EvtQueue[myTail].TimeStamp;
+	_loc_EvtTail=(myTail+1)&(ADC_EVT_QUEUE_LEN-1);
+	return 1;
+}
+
+// Alle Events an die Callback der App weitergeben
+void adc_ProcessEvents_Int(void)
+{
+	adc_Event_t myEvent;
+	
+	while(adc_GetEvent_Int(&myEvent))
+	{
+		adc_AdcFunction(myEvent.ScanId, myEvent.EventId);
+	}
+}
+
+// Anzahl verlorener Events lesen und zurcksetzen
+uint8_t adc_GetEventLost_Int(void)
+{
+	uint8_t myLost;
+	uint8_t mySreg;
+	
+	mySreg=SREG;
+	cli();
+	myLost=_loc_EvtLost;
+	_loc_EvtLost=0;
+	SREG=mySreg;
+	
+	return myLost;
+}
+#endif
+
+#ifdef ADCCALIB
+// Kalibrierung eines Kanals setzen
+// Offset und Gain werden gemeinsam mit gesperrten Interrupts geschrieben
+void adc_SetCalib_Int(uint8_t ScanId, int16_t Offset, uint16_t Gain)
+{
+	uint8_t mySreg;
+	
+	if(ScanId>=ADC_SCAN_CHANNELS) return;
+	
+	mySreg=SREG;
+	cli();
+	_loc_Calib[ScanId].Offset=Offset;
+	_loc_Calib[ScanId].Gain=Gain;
+	SREG=mySreg;
+}
+
+// Kalibrierung eines Kanals lesen
+void adc_GetCalib_Int(uint8_t ScanId, adc_Calib_t * Calib)
+{
+	if(ScanId>=ADC_SCAN_CHANNELS) return;
+	
+	Calib->Offset=_loc_Calib[ScanId].Offset;
+	Calib->Gain=_loc_Calib[ScanId].Gain;
+}
+
+// Kalibrierung aller Kanle im EEPROM speichern, unvernderte Bytes werden nicht neu geschrieben
+void adc_SaveCalib_Int(void)
+{
+	eeprom_update_block((const void *)_loc_Calib, _loc_CalibEe, sizeof(_loc_Calib));
+}
+#endif
+
+#ifdef ADCINJECT
+// Eingeschobene Wandlung anfordern, die ISR fhrt sie bei der nchsten Planung aus
+// ADMUX wird vor dem Flag geschrieben, beide sind 8 Bit und brauchen keine Sperre
+void adc_Inject_Int(uint8_t AdSel, uint8_t VrefSel)
+{
+	_loc_InjMux=(VrefSel<<6) | (AdSel&0x0f);
+	_loc_InjReq=1;
+}
+
+// Ergebnis der letzten eingeschobenen Wandlung lesen
+uint8_t adc_GetInject_Int(uint16_t * Value, uint8_t * AdSel)
+{
+	uint8_t myCnt;
+	uint8_t mySreg;
+	
+	mySreg=SREG;
+	cli();
+	*Value=_loc_InjValue;
+	*AdSel=_loc_InjAdSel;
+	myCnt=_loc_InjCnt;
+	SREG=mySreg;
+	
+	return myCnt;
+}
+#endif
+
+#ifdef ADCCAPTURE
+// Aufzeichnung starten, die ISR fllt zuerst PreTrig Werte und wartet dann auf den Trigger
+uint8_t adc_StartCapture_Int(uint8_t ScanIdA, uint8_t ScanIdB, uint16_t PreTrig, uint8_t TrigEvent, uint8_t Exclusive)
+{
+	uint8_t mySreg;
+	
+	if((ScanIdA>=_loc_ScanLen)||(ScanIdB>=_loc_ScanLen)||(ScanIdA>15)||(ScanIdB>15)) return ADC_ERR_STAT;
+	if(PreTrig>=ADC_CAPT_LEN) return ADC_ERR_STAT;
+	
+	mySreg=SREG;
+	cli();
+	_loc_CaptIdA=ScanIdA;
+	_loc_CaptIdB=ScanIdB;
+	_loc_CaptEvent=TrigEvent;
+	_loc_CaptExcl=Exclusive;
+	_loc_CaptPre=PreTrig;
+	_loc_CaptWr=0;
+	_loc_CaptFill=0;
+	_loc_CaptStatus=ADC_CAPT_ARMED;
+	SREG=mySreg;
+	
+	return ADC_ERR_OK;
+}
+
+// Aufzeichnung aus der App auslsen
+void adc_TriggerCapture_Int(void)
+{
+	uint8_t mySreg;
+	
+	mySreg=SREG;
+	cli();
+	_loc_CaptTrigger();
+	SREG=mySreg;
+}
+
+// Status der Aufzeichnung lesen
+uint8_t adc_GetCaptureStatus_Int(void)
+{
+	return _loc_CaptStatus;
+}
+
+// Anzahl aufgezeichneter Werte und Anzahl Werte vor dem Trigger
+uint16_t adc_GetCaptureLen_Int(uint16_t * PreTrig)
+{
+	if(_loc_CaptStatus!=ADC_CAPT_DONE)
+	{
+		*PreTrig=0;
+		return 0;
+	}
+	*PreTrig=_loc_CaptPre;
+	return _loc_CaptFill;
+}
+
+// Wert Index der Aufzeichnung lesen, 0 = ltester Wert
+// Nach dem Einfrieren ndert die ISR den Puffer nicht mehr, es ist keine Sperre ntig
+uint16_t adc_ReadCapture_Int(uint16_t Index)
+{
+	if((_loc_CaptStatus!=ADC_CAPT_DONE)||(Index>=_loc_CaptFill)) return 0xffff;
+	return _loc_CaptBuf[(_loc_CaptWr-_loc_CaptFill+Index)&(ADC_CAPT_LEN-1)];
+}
+#endif
+
 //-------------------------------------------------------------------
 #endif
\ No newline at end of file
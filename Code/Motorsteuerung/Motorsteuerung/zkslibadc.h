@@ -40,6 +40,9 @@
 #define ADC_CH_VBG	30
 #define ADC_CH_GND	31
 
+// Spannung der internen Bandgap-Referenz in mV
+#define ADC_VBG_MV	1220
+
 
 // Vordefinierte Konstanten zur Referenzauswahl des ADCs
 #define ADC_VREF_EXT	0
@@ -89,6 +92,9 @@
 #define ADC_CH_VBG	14
 #define ADC_CH_GND	15
 
+// Spannung der internen Bandgap-Referenz in mV
+#define ADC_VBG_MV	1100
+
 
 // Vordefinierte Konstanten zur Referenzauswahl des ADCs
 #define ADC_VREF_EXT	0
@@ -106,6 +112,35 @@
 // Konstane fr busy wait beim Lesen der Spannungen
 #define ADC_NWAIT_US 150
 
+// Konstanten fr den Komparator
+// AIN0 = PD6, AIN1 = PD7
+// Die Eingnge ber den ADC-Multiplexer (ADC_COMP_INV_Ax) sind nur bei abgeschaltetem ADC
+// verfgbar, adc_Init_Comp schaltet den ADC dafr aus. Neben dem Interrupt-Betrieb
+// des ADC kann deshalb nur ADC_COMP_INV_AIN1 verwendet werden
+#define ADC_COMP_NINV_AIN0 0
+#define ADC_COMP_NINV_VBG 1
+
+#define ADC_COMP_INV_A0 0
+#define ADC_COMP_INV_A1 1
+#define ADC_COMP_INV_A2 2
+#define ADC_COMP_INV_A3 3
+#define ADC_COMP_INV_A4 4
+#define ADC_COMP_INV_A5 5
+#define ADC_COMP_INV_A6 6
+#define ADC_COMP_INV_A7 7
+#define ADC_COMP_INV_GND 15
+#define ADC_COMP_INV_VBG 14
+#define ADC_COMP_INV_AIN1 32
+
+#define ADC_COMP_INT_NONE		0
+#define ADC_COMP_INT_RISING	1
+#define ADC_COMP_INT_FALLING	2
+#define ADC_COMP_INT_TOGGLE	3
+
+// Das Komparator-Signal zustzlich auf den Input Capture von Timer1 legen (ACIC)
+// Wird zu Interrupt_Select addiert, die Flanke des Captures wird ber ICES1 gewhlt
+#define ADC_COMP_INT_CAPT	0x80
+
 #endif
 
 #ifdef DEVICE_ATTINY85
@@ -118,6 +153,9 @@
 #define ADC_CH_VBG	12
 #define ADC_CH_GND	13
 
+// Spannung der internen Bandgap-Referenz in mV
+#define ADC_VBG_MV	1100
+
 
 
 
@@ -134,7 +172,10 @@
 
 
 // Festelgung der nominalen VCC in mV
+// Startwert bis zur ersten Messung der Bandgap, kann ber die Compiler-Symbole berschrieben werden
+#ifndef ADC_VCC_NOM_MV
 #define ADC_VCC_NOM_MV 3300
+#endif
 
 // Konstanten fr die Verwaltung des Zustands
 #define ADC_STAT_CLOSED 0
@@ -176,6 +217,21 @@ uint16_t adc_Read_mV(uint8_t AdcChannel);
 // Die Absolutwerte werden also im Zhler und Nenner des Spannungsteiler gleich skaliert
 uint16_t adc_Read_mV_Divider(uint8_t AdcChannel, uint8_t R1, uint8_t R2);
 
+// Vorberechnete Umrechnung eines Kanals in mV ohne Division
+// adc_Init_mV_Scale rechnet einmal den Vollausschlag K = Vref*(R1+R2)/R2 in mV aus (muss < 65536 sein),
+// adc_Scale_mV rechnet danach mit mV = ((N<<(16-Bits))*K)>>16, d.h. eine Multiplikation 16x16 Bit
+// und das obere Wort des Produkts. Bits ist die Auflsung des Wertes (10 bzw. 10+OsrBits)
+// Aufwand ca. 50 Takte statt ca. 700 Takte fr die 32-Bit Division in adc_Read_mV_Divider
+// ndert sich die Referenz (z.B. gemessene Vcc), muss adc_Init_mV_Scale erneut aufgerufen werden
+typedef struct
+{
+	uint16_t FullScale;
+	uint8_t Shift;
+} adc_mVScale_t;
+
+uint8_t adc_Init_mV_Scale(adc_mVScale_t * Scale, uint16_t Vref_mV, uint8_t R1, uint8_t R2, uint8_t Bits);
+uint16_t adc_Scale_mV(const adc_mVScale_t * Scale, uint16_t AdcValue);
+
 // Auslesen des gerade aktuellen Kanals ohne Wartezeit. Es wird das zuletzt konvertierte Ergebnis ausgelesen
 // Danach wird der Kanal umgeschaltet. DIe Annahme ist, dass vor dem nchsten Aufruf mindestens 2 Konvertierungen komplettiert wurden
 uint16_t adc_ReadImmediateAndChange_10(uint8_t NextChannel);
@@ -192,6 +248,11 @@ void adc_SetRef(uint8_t RefSelect);
 // Schliessen des ADC fr neue Konfiguration
 void adc_Close();
 
+// Vcc ber die Bandgap-Referenz messen, Ergebnis in mV
+// Die mV-Funktionen verwenden danach den gemessenen Wert. Wird bei adc_Init aufgerufen
+// Nur gltig, wenn Vcc die Referenz ist, sonst wird der bisherige Wert zurckgegeben
+uint16_t adc_Measure_Vcc(void);
+
 
 // Konfigurieren des Komparators
 void adc_Init_Comp(uint8_t NINV_Select, uint8_t INV_Select, uint8_t Interrupt_Select);
@@ -203,9 +264,22 @@ uint8_t adc_Get_Comp(void);
 /*******************************************************************/
 // Erweiterte Funktionen _Int									   */	
 
-// Gibt die Anzahl der zu messenden Kanle im extended Mode an
-
+// Gibt die maximale Anzahl der zu messenden Kanle im extended Mode an
+// Kann ber die Compiler-Symbole berschrieben werden (hchstens 64)
+#ifndef ADC_SCAN_CHANNELS
+#define ADC_SCAN_CHANNELS 4
+#endif
 
+// Trigger-Quellen fr den Start der Wandlungen (Werte fr ADTS in ADCSRB)
+// Die Timer-Quellen werden nur beim ATmega328 untersttzt
+// Die ADC ISR lscht das Flag der Quelle (Compare bzw. Overflow), damit eine neue Flanke entsteht.
+// Der zugehrige Timer-Interrupt darf trotzdem verwendet werden, er lscht das Flag ebenfalls
+#define ADC_TRIG_FREE 0
+#define ADC_TRIG_T0_COMPA 3
+#define ADC_TRIG_T0_OVF 4
+#define ADC_TRIG_T1_COMPB 5
+#define ADC_TRIG_T1_OVF 6
+
 // ADC Events fr die Trigger Funktion
 #define ADC_EVT_TRIG_POS 0
 #define ADC_EVT_TRIG_NEG 1
@@ -214,24 +288,233 @@ uint8_t adc_Get_Comp(void);
 #define ADC_EVT_TRIG_WAIT 4
 
 
+// Filter pro Kanal
+#define ADC_FILT_NONE 0
+#define ADC_FILT_EMA 1
+#define ADC_FILT_BOX 2
+#define ADC_FILT_MED3 3
+
+// Maximale Anzahl Werte fr den Boxcar-Filter
+#define ADC_FILT_TAPS_MAX 8
+
+// Eintrag der Scan-Tabelle, die Tabelle liegt im Flash (PROGMEM)
+// AdSel: Analogeingang ADC_CH_x
+// VrefSel: Referenz ADC_VREF_x
+// Discard: Anzahl Einschwing-Wandlungen, die nach dem Umschalten verworfen werden
+//          0 fr niederohmige Quellen, mindestens 1 nach einem Wechsel der Referenz
+// RateDiv: Kanal wird nur in jedem RateDiv-ten Durchlauf gemessen (1 = jeder Durchlauf)
+//          Mindestens ein Eintrag muss RateDiv 1 haben
+// OsrBits: zustzliche Bits durch Oversampling (0..3). Es werden 4^OsrBits Wandlungen aufsummiert,
+//          das Ergebnis hat 10+OsrBits Bit und wird mit 1/4^OsrBits der Abtastrate ausgegeben.
+//          Trigger-Schwellen beziehen sich auf diese Auflsung
+// Filter: Filter nach dem Oversampling (ADC_FILT_x), die Trigger werden auf dem gefilterten Wert ausgewertet
+// FiltPar: Parameter des Filters
+//          ADC_FILT_EMA: k, y = y + (x-y)/2^k. 10+OsrBits+k darf 16 nicht berschreiten
+//          ADC_FILT_BOX: k, Mittelwert ber 2^k Werte (k = 1..3)
+//          ADC_FILT_MED3: ohne Bedeutung
+typedef struct
+{
+	uint8_t AdSel;
+	uint8_t VrefSel;
+	uint8_t Discard;
+	uint8_t RateDiv;
+	uint8_t OsrBits;
+	uint8_t Filter;
+	uint8_t FiltPar;
+} adc_ScanEntry_t;
+
+// Konsistenter Satz aller Scan-Kanle
+// Value: Werte mit 10+OsrBits Bit, Index ist die ScanId
+// SeqNr: Nummer des Scan-Durchlaufs, 0 = noch kein Durchlauf abgeschlossen
+// TimeStamp: Ende des Durchlaufs in Wandlungen seit Start (1 Wandlung = 13 ADC-Takte bzw. 1 Trigger)
+typedef struct
+{
+	uint16_t Value[ADC_SCAN_CHANNELS];
+	uint16_t SeqNr;
+	uint16_t TimeStamp;
+} adc_Snapshot_t;
+
 // Deklaration der optionalen Callback-Funktionen
+// Ohne ADCEVENTQUEUE wird die Callback direkt in der ADC ISR aufgerufen
 extern void adc_AdcFunction(uint8_t ScanId, uint8_t EventId);
 
+#ifdef ADCEVENTQUEUE
+// Mit dem Symbol ADCEVENTQUEUE legt die ISR die Events nur in einer Queue ab,
+// die Callback wird erst von adc_ProcessEvents_Int im Hauptprogramm aufgerufen.
+// Die ISR braucht dafr pro Event eine konstante, kurze Zeit.
+// Ist die Queue voll, wird das Event verworfen und der Verlust-Zhler erhht
+
+// Anzahl Events in der Queue (Zweierpotenz, es sind ADC_EVT_QUEUE_LEN-1 nutzbar)
+#ifndef ADC_EVT_QUEUE_LEN
+#define ADC_EVT_QUEUE_LEN 8
+#endif
+
+// Event aus der Queue
+// Value: Wert des Kanals beim Event (nach Filter und Kalibrierung)
+// TimeStamp: Zeitpunkt in Wandlungen seit Start, wie beim Snapshot
+typedef struct
+{
+	uint8_t ScanId;
+	uint8_t EventId;
+	uint16_t Value;
+	uint16_t TimeStamp;
+} adc_Event_t;
+
+// ltestes Event aus der Queue holen, Rckgabewert 0 = Queue leer
+uint8_t adc_GetEvent_Int(adc_Event_t * Event);
+
+// Alle Events der Queue an adc_AdcFunction weitergeben
+void adc_ProcessEvents_Int(void);
+
+// Anzahl verlorener Events (bleibt bei 255 stehen), wird beim Lesen zurckgesetzt
+uint8_t adc_GetEventLost_Int(void);
+#endif
+
 // Initialisierung fr eine bestimmtes Timing-Setup
 // Scan Pattern:
 // Jedes Bit steht fr einen zu messenden Kanal
 uint8_t adc_Init_Int(uint8_t ClkDiv);
 
+// Trigger-Quelle whlen (ADC_TRIG_x), Aufruf vor adc_Init_Int bzw. adc_Init_Scan_Int
+// Mit einem Timer-Trigger wird pro Timer-Ereignis genau eine Wandlung gestartet.
+// Die Wandlung muss vor dem nchsten Trigger fertig sein (13 ADC-Takte)
+void adc_SetTrigger_Int(uint8_t TrigSource);
+
+// Initialisierung mit einer Scan-Tabelle im Flash
+// ScanTable: Tabelle mit NEntries Eintrgen (hchstens ADC_SCAN_CHANNELS), Index ist die ScanId
+// Im Unterschied zu adc_Init_Int werden Referenz und Kanal aus der Tabelle bernommen
+uint8_t adc_Init_Scan_Int(const adc_ScanEntry_t * ScanTable, uint8_t NEntries, uint8_t ClkDiv);
+
 // Referenz, Triggerbedingung und Analogeingang fr einen Kanal definieren
 void adc_ConfigChannel_Int(uint8_t ScanId, uint8_t AdSel, uint8_t VrefSel, uint16_t TrigPos, uint16_t TrigNeg, uint8_t Hyst);
 
 // Einen gewandelten Wert auslesen
 uint16_t adc_Read_Value_Int(uint8_t AdSel);
 
+// Einen gewandelten Wert als 8-Bit Wert auslesen (ohne Wartezeit)
+// Ersatz fr adc_Read_8, wenn der ADC im Interrupt-Betrieb luft
+uint8_t adc_Read_8_Int(uint8_t ScanId);
+
+// Alle Scan-Kanle aus dem selben Scan-Durchlauf lesen
+// Die Werte werden nach Snapshot kopiert, die ISR wird dabei nicht blockiert
+void adc_GetSnapshot_Int(adc_Snapshot_t * Snapshot);
+
+// Vcc in mV aus dem Bandgap-Eintrag der Scan-Tabelle
+// Die Scan-Tabelle muss dazu einen Eintrag mit ADC_CH_VBG und ADC_VREF_VCC enthalten,
+// mit mindestens einer Einschwing-Wandlung. Ohne diesen Eintrag wird ADC_VCC_NOM_MV geliefert
+// Die Division wird nur nach einem neuen Bandgap-Wert ausgefhrt
+uint16_t adc_Get_Vcc_mV_Int(void);
+
 // Einen gewandelten Wert in mV umrechnen
+// Vref: Referenz in mV oder ADC_VREF_MV_VCC fr die gemessene Vcc (adc_Get_Vcc_mV_Int)
+#define ADC_VREF_MV_VCC 0
 uint16_t adc_Convert_mV_Int(int32_t AdcValue, int32_t Vref, uint8_t R1, uint8_t R2);
 
 
+#ifdef ADCCALIB
+/*******************************************************************/
+// Kalibrierung pro Scan-Kanal										   */
+// Wert = (Roh - Offset) * Gain / 2^15, angewendet nach dem Filter und vor den Triggern
+// Offset in der Auflsung des Kanals (10+OsrBits Bit), Gain im Q15-Format (32768 = 1.0, < 2.0)
+// Die Kalibrierung wird im EEPROM gespeichert und bei adc_Init_Int bzw. adc_Init_Scan_Int geladen
+// Um die Erweiterung beim Kompilieren zu aktivieren, muss zustzlich das Symbol
+// ADCCALIB definiert sein
+#define ADC_CALIB_GAIN_ONE 32768
+
+// Gain eines gelschten EEPROMs, der Kanal wird dann nicht korrigiert
+#define ADC_CALIB_GAIN_INVALID 0xffff
+
+typedef struct
+{
+	int16_t Offset;
+	uint16_t Gain;
+} adc_Calib_t;
+
+// Kalibrierung eines Kanals setzen, wirkt sofort (noch nicht im EEPROM gespeichert)
+void adc_SetCalib_Int(uint8_t ScanId, int16_t Offset, uint16_t Gain);
+
+// Kalibrierung eines Kanals lesen
+void adc_GetCalib_Int(uint8_t ScanId, adc_Calib_t * Calib);
+
+// Kalibrierung aller Kanle im EEPROM speichern
+void adc_SaveCalib_Int(void);
+#endif
+
+#ifdef ADCINJECT
+/*******************************************************************/
+// Eingeschobene Einzelwandlung									   */
+// Eine Wandlung ausserhalb der Scan-Tabelle, z.B. fr die Gegen-EMK in der Aus-Phase der PWM.
+// Sie ersetzt eine Wandlung des Scans, das Ergebnis (10 Bit) luft nicht durch Oversampling,
+// Filter, Kalibrierung und Aufzeichnung. Ein dadurch unterbrochenes Einschwingen des Scans beginnt neu.
+// Um die Erweiterung beim Kompilieren zu aktivieren, muss zustzlich das Symbol
+// ADCINJECT definiert sein
+
+// Wandlung anfordern
+// Der Multiplexer wird nach jeder Wandlung fr die nchste eingestellt. Mit Timer-Trigger gilt:
+// erfolgt der Aufruf zwischen einem Trigger und dem Ende der dadurch gestarteten Wandlung
+// (z.B. in der Compare ISR der Trigger-Quelle), wird genau beim nchsten Trigger gewandelt, sonst beim bernchsten
+// Im Free Running Mode erfolgt die Wandlung zwei Wandlungen nach dem nchsten Interrupt
+void adc_Inject_Int(uint8_t AdSel, uint8_t VrefSel);
+
+// Letztes Ergebnis lesen
+// Value: Wandlungsergebnis, AdSel: gewandelter Eingang (ADC_CH_x)
+// Rckgabe: Anzahl abgeschlossener Wandlungen (8 Bit, luft ber), ndert sich mit jedem neuen Wert
+uint8_t adc_GetInject_Int(uint16_t * Value, uint8_t * AdSel);
+#endif
+
+#ifdef ADCCAPTURE
+/*******************************************************************/
+// Burst-Aufzeichnung mit Pre-Trigger								   */
+// Die Roh-Wandlungen (10 Bit, vor Oversampling und Filter) von einem oder zwei
+// Scan-Eintrgen werden laufend in einen Ringpuffer geschrieben. Nach dem Trigger
+// werden noch ADC_CAPT_LEN-PreTrig Werte aufgezeichnet, danach wird der Puffer eingefroren.
+// Um die Erweiterung beim Kompilieren zu aktivieren, muss zustzlich das Symbol
+// ADCCAPTURE definiert sein
+
+// Grsse des Ringpuffers in Werten (Zweierpotenz), belegt 2*ADC_CAPT_LEN Byte RAM
+// Kann ber die Compiler-Symbole berschrieben werden
+#ifndef ADC_CAPT_LEN
+#define ADC_CAPT_LEN 256
+#endif
+
+// Status der Aufzeichnung
+#define ADC_CAPT_IDLE 0
+#define ADC_CAPT_ARMED 1
+#define ADC_CAPT_POST 2
+#define ADC_CAPT_DONE 3
+
+// Aufzeichnung nur ber adc_TriggerCapture_Int auslsen
+#define ADC_CAPT_NOEVT 0xff
+
+// Aufbau eines Wertes im Puffer
+// Bit 15..12: ScanId, Bit 9..0: Wandlungsergebnis
+#define ADC_CAPT_VALUE(x) ((x)&0x03ff)
+#define ADC_CAPT_SCANID(x) ((uint8_t)((x)>>12))
+
+// Aufzeichnung starten
+// ScanIdA, ScanIdB: aufzuzeichnende Eintrge der Scan-Tabelle (ScanIdB=ScanIdA fr einen Kanal, ScanId<16)
+// PreTrig: Anzahl Werte vor dem Trigger (kleiner als ADC_CAPT_LEN)
+// TrigEvent: ADC_EVT_TRIG_x des Eintrags ScanIdA, das die Aufzeichnung auslst, oder ADC_CAPT_NOEVT
+// Exclusive: 1 = whrend der Aufzeichnung werden nur ScanIdA und ScanIdB gewandelt (maximale Abtastrate),
+//            die brigen Kanle im Snapshot werden solange nicht aktualisiert
+//            0 = der Scan luft normal weiter, aufgezeichnet wird mit der Abtastrate der Kanle
+uint8_t adc_StartCapture_Int(uint8_t ScanIdA, uint8_t ScanIdB, uint16_t PreTrig, uint8_t TrigEvent, uint8_t Exclusive);
+
+// Aufzeichnung aus der App auslsen (z.B. Richtungswechsel, Befehl ber UART)
+// Wirkt nur im Status ADC_CAPT_ARMED
+void adc_TriggerCapture_Int(void);
+
+// Status der Aufzeichnung lesen (ADC_CAPT_x)
+uint8_t adc_GetCaptureStatus_Int(void);
+
+// Anzahl aufgezeichneter Werte, PreTrig erhlt die Anzahl Werte vor dem Trigger
+// Gltig im Status ADC_CAPT_DONE
+uint16_t adc_GetCaptureLen_Int(uint16_t * PreTrig);
+
+// Wert Index der Aufzeichnung lesen, 0 = ltester Wert
+uint16_t adc_ReadCapture_Int(uint16_t Index);
+#endif
+
 #endif
 
 #ifdef COMPFUNCTION
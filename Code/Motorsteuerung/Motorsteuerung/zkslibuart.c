@@ -26,11 +26,11 @@ FILE uart_str = FDEV_SETUP_STREAM(_uart_put, NULL, _FDEV_SETUP_WRITE);
 #endif
 
 
+#ifdef UART_USE_EXCH
+
 static uint8_t _loc_RxFlow=0;	
 static uint8_t _loc_TxFlow=0;
 
-#ifdef UART_USE_EXCH
-
 static uint8_t _loc_UartRxBuffer[UART_EXCH_BUF_SIZE];
 static uint8_t _loc_UartRxCnt=0;	
 
@@ -283,6 +283,12 @@ uint8_t _loc_TxComplete(void)
 	return Result;
 }
 
+// Datenregister frei fr das nchste Byte ?
+uint8_t _loc_TxReady(void)
+{
+	return ((UCSRA & (1<<UDRE)) != 0);
+}
+
 // Empfangsregister lesen und ausgeben
 uint8_t _loc_GetRxData(void)
 {
@@ -387,6 +393,12 @@ uint8_t _loc_TxComplete(void)
 	
 }
 
+/* Prft ob das Datenregister frei ist, ohne ein Flag zu lschen */
+uint8_t _loc_TxReady(void)
+{
+	return ((UCSR0A & (1<<UDRE0)) != 0);
+}
+
 /* Gibt empfangene Daten zurck */
 uint8_t _loc_GetRxData(void)
 {
@@ -577,6 +589,12 @@ uint8_t _loc_TxComplete(void)
 	
 }
 
+/* Prft ob das Datenregister frei ist, ohne ein Flag zu lschen */
+uint8_t _loc_TxReady(void)
+{
+	return ((UCSR0A & (1<<UDRE)) != 0);
+}
+
 /* Gibt empfangene Daten zurck */
 uint8_t _loc_GetRxData(void)
 {
@@ -660,6 +678,14 @@ uint8_t uart_SendComplete(void)
 	return _loc_TxComplete();
 }
 
+// Prft ob das Datenregister ein weiteres Byte aufnehmen kann (UDRE), ohne zu warten
+// TRUE: uart_SendByte(Data, UART_NO) berschreibt kein laufendes Byte
+// Anders als uart_SendComplete wird dabei kein Flag gelscht
+uint8_t uart_TxReady(void)
+{
+	return _loc_TxReady();
+}
+
 // Warten auf empfangene Daten mit Timeout
 // TRUE: Daten wurden empfangen
 // FALSE: Timeout
@@ -736,7 +762,9 @@ void uart_SendByte(uint8_t Data, uint8_t WaitYesNo)
 // Rckgabewert: die Anzahld er noch freien Speicherpltze im Puffer
 uint8_t uart_AddByte(uint8_t Data)
 {
-	
+	// Ohne Ausgangspuffer (UART_USE_EXCH) wird das Byte direkt gesendet, es bleibt kein Platz frei
+	uart_SendByte(Data,UART_YES);
+	return 0;
 }
 
 // Sendet einen Text ber die Schnittstelle, optional mit nachfolgendem CRLF
@@ -79,6 +79,11 @@ uint8_t uart_NewData(void);
 // FALSE: Sendung luft noch
 uint8_t uart_SendComplete(void);
 
+// Prft ob das Datenregister ein weiteres Byte aufnehmen kann, ohne zu warten
+// TRUE: das nchste Byte kann mit uart_SendByte(Data, UART_NO) gesendet werden
+// FALSE: das vorherige Byte wartet noch auf das Schieberegister
+uint8_t uart_TxReady(void);
+
 // Warten auf empfangene Daten mit Timeout
 // TRUE: Daten wurden empfangen
 // FALSE: Timeout
@@ -131,6 +136,11 @@ uint8_t uart_WaitCmd();
 // N muss >=1 und <=12 sein
 void uart_UintToUart(uint32_t x, char N);
 
+// Umwandlung einer Unsigned Integer-Variable in Text, ohne zu senden (z.B. fr einen eigenen Sendepuffer)
+// NDigit: Anzahl Stellen mit fhrenden Nullen (1..10), 0 = so viele Stellen wie ntig
+// Rckgabewert: Anzahl Zeichen im TextBuffer (ohne abschliessende Null)
+uint8_t uart_Uint2Txt(uint32_t  BinData, char * TextBuffer, char NDigit);
+
 // Ausgabe einer Integer-Variable als Zeichenfolge auf die uart
 // x: Variable, N: Anzahl Stellen inklusive Vorzeichen
 // es wird immer eine Vorzeichen ausgegeben + oder -.